@@ -4,10 +4,169 @@ let (|>) x f = f x
 let (|<) f x = f x
 
 let font = Glut.BITMAP_HELVETICA_12
-let draw_string ?(font=font) x y s =
-  GlPix.raster_pos ~x ~y ();
-  String.iter (fun c -> Glut.bitmapCharacter ~font ~c:(Char.code c)) s
-;;
+
+(* Labels are numbers, their glyphs are rasterised once (with GLUT,
+   into the back buffer) and kept in a texture atlas. A label is a
+   vertex array with a textured quad per character, rebuilt only when
+   its text or position changes, and drawn with a single call in
+   window coordinates *)
+module Text =
+struct
+  let chars = "0123456789.% "
+  let cellh = 16
+  let base = 4
+  let cellw = ref 0
+  let tw = ref 1
+  let tex = ref None
+  let ww = ref 1
+  let wh = ref 1
+
+  type label =
+      { key : (int * int * string) ref;
+        quadv : [`float] Raw.t;
+        quadt : [`float] Raw.t;
+        nquads : int ref;
+      }
+  ;;
+
+  let build () =
+    let () =
+      for i = 0 to String.length chars - 1 do
+        cellw := max !cellw (Glut.bitmapWidth font (Char.code chars.[i]))
+      done;
+      while !tw < !cellw * String.length chars do tw := !tw * 2 done
+    in
+    let cellw = !cellw and tw = !tw in
+    let img =
+      GlPix.create `ubyte ~format:`luminance_alpha ~width:tw ~height:cellh
+    in
+    let raw = GlPix.to_raw img in
+    let glyph i c =
+      GlClear.clear [`color];
+      GlPix.raster_pos ~x:~-.1.0
+        ~y:(2.0 *. float base /. float cellh -. 1.0) ();
+      Glut.bitmapCharacter ~font ~c:(Char.code c);
+      let cell =
+        GlPix.read ~x:0 ~y:0 ~width:cellw ~height:cellh
+          ~format:`luminance ~kind:`ubyte |> GlPix.to_raw
+      in
+        for y = 0 to cellh - 1 do
+          for x = 0 to cellw - 1 do
+            let pos = 2 * (y * tw + i * cellw + x) in
+              Raw.set raw ~pos 255;
+              Raw.set raw ~pos:(pos + 1) (Raw.get cell ~pos:(y * cellw + x))
+          done
+        done
+    in
+    let t = GlTex.gen_texture () in
+      for i = 0 to tw * cellh * 2 - 1 do Raw.set raw ~pos:i 0 done;
+      GlDraw.viewport 0 0 cellw cellh;
+      GlMat.mode `modelview;
+      GlMat.load_identity ();
+      GlMat.mode `projection;
+      GlMat.load_identity ();
+      GlDraw.color (1.0, 1.0, 1.0);
+      GlPix.store (`pack_alignment 1);
+      for i = 0 to String.length chars - 1 do glyph i chars.[i] done;
+      GlClear.clear [`color];
+      GlTex.bind_texture ~target:`texture_2d t;
+      List.iter (GlTex.parameter ~target:`texture_2d)
+        [ `mag_filter `nearest
+        ; `min_filter `nearest
+        ; `wrap_s `clamp
+        ; `wrap_t `clamp
+        ];
+      GlPix.store (`unpack_alignment 1);
+      GlTex.image2d img;
+      tex := Some t;
+  ;;
+
+  (* called with the GL context current before anything is drawn *)
+  let reshape w h =
+    ww := w;
+    wh := h;
+    if !tex = None then build ();
+  ;;
+
+  let label n =
+    { key = ref (0, 0, "");
+      quadv = Raw.create_static `float ~len:(n * 8);
+      quadt = Raw.create_static `float ~len:(n * 8);
+      nquads = ref 0;
+    }
+  ;;
+
+  (* text s with its baseline starting at window pixel (x, y) *)
+  let set l x y s =
+    if !(l.key) <> (x, y, s)
+    then
+      let put k (vx, vy) (tx, ty) =
+        Raw.set_float l.quadv ~pos:(k * 2) vx;
+        Raw.set_float l.quadv ~pos:(k * 2 + 1) vy;
+        Raw.set_float l.quadt ~pos:(k * 2) tx;
+        Raw.set_float l.quadt ~pos:(k * 2 + 1) ty;
+      in
+      let rec loop i k px =
+        if i < String.length s && k * 8 < Raw.length l.quadv
+        then
+          let c =
+            try Some (String.index chars s.[i]) with Not_found -> None
+          in
+            begin match c with
+              | None -> loop (i + 1) k px
+              | Some c ->
+                  let w = Glut.bitmapWidth font (Char.code s.[i]) in
+                  let x0 = float px and x1 = float (px + w)
+                  and y0 = float (y - base) and y1 = float (y - base + cellh)
+                  and u0 = float (c * !cellw) /. float !tw
+                  and u1 = float (c * !cellw + w) /. float !tw in
+                    put (k * 4) (x0, y0) (u0, 0.0);
+                    put (k * 4 + 1) (x1, y0) (u1, 0.0);
+                    put (k * 4 + 2) (x1, y1) (u1, 1.0);
+                    put (k * 4 + 3) (x0, y1) (u0, 1.0);
+                    loop (i + 1) (k + 1) (px + w)
+            end
+        else
+          k
+      in
+        l.key := (x, y, s);
+        l.nquads := loop 0 0 x;
+  ;;
+
+  (* leaves the viewport to the caller and the matrix mode at projection
+     like View.reshape does *)
+  let draw l =
+    match !tex with
+      | Some t when !(l.nquads) > 0 ->
+          GlDraw.viewport 0 0 !ww !wh;
+          GlMat.mode `modelview;
+          GlMat.push ();
+          GlMat.load_identity ();
+          GlMat.mode `projection;
+          GlMat.push ();
+          GlMat.load_identity ();
+          GlMat.ortho ~x:(0.0, float !ww) ~y:(0.0, float !wh) ~z:(-1.0, 1.0);
+          Gl.enable `texture_2d;
+          Gl.enable `blend;
+          GlFunc.blend_func ~src:`src_alpha ~dst:`one_minus_src_alpha;
+          GlTex.bind_texture ~target:`texture_2d t;
+          GlTex.env (`mode `modulate);
+          GlArray.enable `vertex;
+          GlArray.enable `texture_coord;
+          GlArray.vertex `two l.quadv;
+          GlArray.tex_coord `two l.quadt;
+          GlArray.draw_arrays `quads ~first:0 ~count:(!(l.nquads) * 4);
+          GlArray.disable `texture_coord;
+          GlArray.disable `vertex;
+          Gl.disable `blend;
+          Gl.disable `texture_2d;
+          GlMat.pop ();
+          GlMat.mode `modelview;
+          GlMat.pop ();
+          GlMat.mode `projection;
+      | _ -> ()
+  ;;
+end
 
 type stats =
     { all : float
@@ -91,11 +250,48 @@ struct
       | MacOSX
   ;;
 
+  type idlesrc =
+      | Itc of Unix.file_descr
+      | Cpuidle
+  ;;
+
   external get_nprocs : unit -> int = "ml_get_nprocs"
   external idletimeofday : Unix.file_descr -> int -> float array
     = "ml_idletimeofday"
+  external stat_into :
+    (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t -> unit
+    = "ml_stat_into"
+  external cpuidle_open : int -> bool = "ml_cpuidle_open"
+  external snapshot :
+    idlesrc ->
+    (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t -> unit
+    = "ml_snapshot"
+  external sampler_start : idlesrc -> int -> int -> float -> int -> unit
+    = "ml_sampler_start"
+  external sampler_next :
+    float ->
+    (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t -> int
+    = "ml_sampler_next"
+  external shm_publish : string -> int -> int -> float -> unit
+    = "ml_shm_publish"
+  external shm_attach : string -> int * int * float = "ml_shm_attach"
+  external shm_latest :
+    (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t -> float
+    = "ml_shm_latest"
+  external write_floats :
+    Unix.file_descr ->
+    (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t -> unit
+    = "ml_write_floats"
   external sysinfo : unit -> sysinfo = "ml_sysinfo"
   external waitalrm : unit -> unit = "ml_waitalrm"
+  external ticker_start : float -> unit = "ml_ticker_start"
+  external ticker_wait : float -> int = "ml_ticker_wait"
   external get_hz : unit -> int = "ml_get_hz"
   external setnice : int -> unit = "ml_nice"
   external delay : float -> unit = "ml_delay"
@@ -106,6 +302,11 @@ struct
   external windows_processor_times : int -> float array =
       "ml_windows_processor_times"
   external fixwindow : int -> unit = "ml_fixwindow"
+  external tex_column :
+    int ->
+    (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+    unit
+    = "ml_tex_column"
   external testpmc : unit -> bool = "ml_testpmc"
 
   let os_type = os_type ()
@@ -122,6 +323,7 @@ struct
   let iowait  = 4
   let intr    = 5
   let softirq = 6
+  let nfields = 7
 
   let hz = get_hz () |> float
 
@@ -134,59 +336,22 @@ struct
 
   let nprocs = get_nprocs ()
 
-  let rec parse_int_cont s pos =
-    let jiffies_to_sec j =
-      float j /. hz
-    in
-    let slen = String.length s in
-    let pos =
-      let rec skipws pos =
-        if pos = slen
-        then
-          pos
-        else
-          begin
-            if String.get s pos = ' '
-            then
-              succ pos |> skipws
-            else
-              pos
-          end
-      in skipws pos
-    in
-    let endpos =
-      try String.index_from s pos ' '
-      with Not_found -> slen
-    in
-    let i = endpos - pos |> String.sub s pos
-                         |> int_of_string
-                         |> jiffies_to_sec in
-      if endpos = slen
-      then
-        `last i
-      else
-        `more (i, fun () -> succ endpos |> parse_int_cont s)
-  ;;
-
-  let parse_cpul s =
-    let rec tolist accu = function
-      | `last i -> i :: accu
-      | `more (i, f) -> f () |> tolist (i :: accu)
+  (* Returns a sampler which refills and returns one buffer holding
+     nfields values for the aggregate followed by every CPU *)
+  let parse_stat () =
+    let buf =
+      Bigarray.Array1.create Bigarray.float64 Bigarray.c_layout
+        ((nprocs + 1) * nfields)
     in
-    let index = String.index s ' ' in
-    let cpuname = String.sub s 0 index in
-    let vals = parse_int_cont s (succ index) |> tolist [] in
-    let vals = List.rev |<
-        if List.length vals < 7
-        then
-          0.0 :: 0.0 :: 0.0 :: 0.0 :: vals
-        else
-          vals
+    let fill l =
+      let rec loop i = function
+        | [] -> buf
+        | (_, vals) :: rest ->
+            Array.iteri (fun j v -> buf.{i * nfields + j} <- v) vals;
+            loop (succ i) rest
+      in
+        loop 0 l
     in
-      cpuname, Array.of_list vals
-  ;;
-
-  let parse_stat () =
     match os_type with
       | Windows ->
           (fun () ->
@@ -211,23 +376,11 @@ struct
                 let accu = (hdr, [| u; d; k; i; 0.0; r; 0.0 |]) :: accu in
                   create (succ n) ai ak au ad ar accu
             in
-              create 0 0.0 0.0 0.0 0.0 0.0 []
+              create 0 0.0 0.0 0.0 0.0 0.0 [] |> fill
           )
 
       | Linux ->
-          (fun () ->
-            let ic = open_in "/proc/stat" in
-            let rec loop i accu =
-              if i = -1
-              then
-                List.rev accu
-              else
-                (input_line ic |> parse_cpul) :: accu |> loop (pred i)
-            in
-            let ret = loop nprocs [] in
-              close_in ic;
-              ret
-          )
+          (fun () -> stat_into buf; buf)
 
       | Solaris ->
           (fun () ->
@@ -250,7 +403,7 @@ struct
                 let accu = (hdr, [| u; 0.0; k; i; w; 0.0; 0.0 |]) :: accu in
                   create (succ n) ai au ak aw accu
             in
-              create 0 0.0 0.0 0.0 0.0 []
+              create 0 0.0 0.0 0.0 0.0 [] |> fill
           )
 
       | MacOSX ->
@@ -274,7 +427,7 @@ struct
                 let accu = (hdr, [| u; n; k; i; 0.0; 0.0; 0.0 |]) :: accu in
                   create (succ c) ai au ak an accu
             in
-              create 0 0.0 0.0 0.0 0.0 []
+              create 0 0.0 0.0 0.0 0.0 [] |> fill
           )
   ;;
 end
@@ -300,7 +453,6 @@ struct
   let isampler = ref true
   let barw     = ref 100
   let bars     = ref 50
-  let sigway   = ref (NP.os_type != NP.MacOSX)
   let niceval  = ref 0
   let gzh      = ref false
   let scalebar = ref false
@@ -313,6 +465,18 @@ struct
   let mgrid    = ref false
   let sepstat  = ref true
   let grid_green = ref 0.75
+  let cpuidle  = ref false
+  let pin      = ref ~-1
+  let headless = ref false
+  let outpath  = ref "-"
+  let binary   = ref false
+  let record   = ref ""
+  let replay   = ref ""
+  let speed    = ref 1.0
+  let seek     = ref 0.0
+  let heatmap  = ref false
+  let publish  = ref ""
+  let attach   = ref ""
 
   let pad n s =
     let l = String.length s in
@@ -361,7 +525,7 @@ struct
 
   let commonopts =
     [ sF "f" freq "sampling frequency in seconds"
-    ; sF "D" delay "refresh delay in seconds"
+    ; sF "D" delay "minimum time between frames in seconds"
     ; sF "i" interval "history interval in seconds"
     ; sI "p" pgrid "percent grid items"
     ; sI "s" sgrid "history grid items"
@@ -375,21 +539,32 @@ struct
     ; fB "P" poly "filled area instead of lines"
     ; fB "l" labels "labels"
     ; fB "m" mgrid "moving grid"
+    ; fB "H" heatmap "one heatmap (a row per CPU) instead of graphs"
+    ; sB "headless" headless "collect without X/GL, write records to -out"
+    ; sS "out" outpath "headless output file (- for stdout, empty for none)"
+    ; sB "binary" binary "headless records as float64 instead of CSV"
+    ; sS "record" record "append every sample to this file"
+    ; sS "replay" replay "show a -record file instead of sampling"
+    ; sF "speed" speed "replay speed (1 is real time)"
+    ; sF "seek" seek "start replay this many seconds into the file"
     ]
   ;;
 
   let add_opts tail =
     let add_linux opts =
-      sI "t" timer "timer frequency in herz"
+      sI "t" timer "event polling frequency in herz while waiting for a tick"
       :: fB "I" icon "icon (hack)"
       :: sS "d" devpath "path to itc device"
+      :: fB "x" cpuidle "idle sampler from cpuidle sysfs residencies"
+      :: sI "A" pin "CPU to pin the sampler thread to (-1 none)"
+      :: sS "publish" publish "also publish samples in this shared memory"
+      :: sS "attach" attach "show samples another apc -publish-es"
       :: (fB "k" ksampler |< "kernel sampler (`/proc/[stat|uptime]')")
       :: (fB "M" isampler |< "idle sampler")
       :: (fB "u" uptime
              "`uptime' instead of `stat' as kernel sampler (UP only)")
       :: sI "n" niceval "value to renice self on init"
       :: fB "g" gzh "gzh way (does not quite work yet)"
-      :: fB "S" sigway "sigwait delay method"
       :: opts
     in
     let add_solaris opts =
@@ -441,6 +616,7 @@ struct
         cpf freq "Frequency";
         cpf delay "Delay";
         cpf interval "Interval";
+        cpf speed "Speed";
         if not (!isampler || !ksampler)
         then
           barw := 0
@@ -526,144 +702,219 @@ struct
   ;;
 end
 
-let oohz oohz fn =
-  let prev = ref 0.0 in
-    fun () ->
-      let a = !prev in
-      let b = Unix.gettimeofday () in
-        if b -. a > oohz
-        then
-          begin
-            prev := b;
-            fn ()
-          end
-;;
-
-module Delay =
+module Ticker =
 struct
-  let sighandler signr = ()
-
-  let winfreq = ref 0.0
+  (* Windows has no ticker primitive, the same absolute deadline
+     arithmetic is done here on top of NP.delay *)
+  let winperiod = ref 0.0
+  let winnext = ref 0.0
 
-  let init freq gzh =
+  let start period =
     if NP.winnt
     then
-      winfreq := 1.0 /. float freq
+      begin
+        winperiod := period;
+        winnext := Unix.gettimeofday () +. period
+      end
     else
-      let () =
-        Sys.Signal_handle sighandler |> Sys.set_signal Sys.sigalrm;
-        if !Args.sigway
-        then
-          let l =
-            if gzh
-            then
-              [Sys.sigprof; Sys.sigvtalrm]
-            else
-              []
-          in
-            Unix.sigprocmask Unix.SIG_BLOCK |< Sys.sigalrm :: l |> ignore;
-      ;
-      in
-      let v = 1.0 /. float freq in
-      let t = { Unix.it_interval = v; it_value = v } in
-      let _ = Unix.setitimer Unix.ITIMER_REAL t in
-        ()
+      NP.ticker_start period
   ;;
 
-  let delay () =
+  (* number of ticks since the previous call, 0 if timeout came first *)
+  let wait timeout =
     if NP.winnt
     then
-      NP.delay !winfreq
-    else
-      begin
-        if !Args.sigway
+      let now = Unix.gettimeofday () in
+      let now =
+        if now < !winnext
         then
-          NP.waitalrm ()
+          (NP.delay (min timeout (!winnext -. now)); Unix.gettimeofday ())
         else
-          begin
-            try let _ = Unix.select [] [] [] ~-.1.0 in ()
-            with Unix.Unix_error (Unix.EINTR, _, _) -> ()
-          end
-      end
+          now
+      in
+        if now < !winnext
+        then
+          0
+        else
+          let n = (now -. !winnext) /. !winperiod |> truncate |> succ in
+            winnext := !winnext +. float n *. !winperiod;
+            n
+    else
+      NP.ticker_wait timeout
   ;;
 end
 
+(* Sampler history is kept only as the vertex arrays that draw it.
+   Per level, `line' holds an (x, mean) vertex per entry, `pairs' two
+   per entry, (x, min) and (x, max) or, with -P, (x, 0) and (x, mean).
+   x is the entry's time (seconds, as srcs.time) minus timebase,
+   entries first .. first + count - 1 are the current history oldest
+   first *)
+type verts =
+    { decimated : bool;
+      line : [`double] Raw.t;
+      pairs : [`double] Raw.t;
+      first : int;
+      count : int;
+    }
+;;
+
+let timebase = ref nan
+
 type sampler =
     { color : Gl.rgb;
-      getyielder : unit -> unit -> float option;
-      update : float -> float -> unit;
+      getverts : int -> verts;
+      latest : unit -> float;
+      update : float -> float -> float -> unit;
     }
 ;;
 
 module Sampler (T : sig val nsamples : int val freq : float end) =
 struct
   let nsamples = T.nsamples + 1
-  let samples = Array.create nsamples 0.0
-  let head = ref 0
-  let tail = ref 0
-  let active = ref 0
 
-  let update v n =
-    let n = min nsamples n in
-    let rec loop i j =
-      if j = 0
-      then
-        ()
-      else
-        let i =
-          if i = nsamples
-          then
-            0
-          else
-            i
-        in
-          Array.set samples i v;
-          loop (succ i) (pred j)
-    in
-    let () = loop !head n in
-    let () = head := (!head + n) mod nsamples in
-    let () = active := min (!active + n) nsamples in
-      ();
+  (* History is a pyramid of rings, an entry of a level stands for
+     `ratio' consecutive samples by their mean time, mean, minimum and
+     maximum and every level is `factor' times coarser than the one
+     below. Levels with more entries than even a maxpixels wide graph
+     could show are not kept, so memory and drawing cost follow the
+     window size rather than -i / -f. Every completed entry feeds the
+     accumulator of the next level up, an update costs O(1) amortized *)
+  let factor = 16
+  let maxpixels = 4096
+
+  type level =
+      { ratio : int;                    (* samples per entry *)
+        step : int;                     (* inputs per entry *)
+        size : int;
+        lverts : [`double] Raw.t;
+        pverts : [`double] Raw.t;
+        head : int ref;
+        active : int ref;
+        pending : int ref;
+        tsum : float ref;
+        sum : float ref;
+        amin : float ref;
+        amax : float ref;
+      }
   ;;
 
-  let getyielder () =
-    let tail =
-      let d = !head - !active in
-        if d < 0
+  let levels =
+    let rec build ratio step accu =
+      let size = max 1 (nsamples / ratio) in
+      let accu, step =
+        if size > maxpixels * factor
         then
-          nsamples + d
+          accu, step * factor
         else
-          d
+          { ratio = ratio
+          ; step = step
+          ; size = size
+          ; lverts = Raw.create_static `double ~len:(2 * size * 2)
+          ; pverts = Raw.create_static `double ~len:(2 * size * 4)
+          ; head = ref 0
+          ; active = ref 0
+          ; pending = ref 0
+          ; tsum = ref 0.0
+          ; sum = ref 0.0
+          ; amin = ref 0.0
+          ; amax = ref 0.0
+          } :: accu, factor
+      in
+        if size <= factor
+        then
+          List.rev accu |> Array.of_list
+        else
+          build (ratio * factor) step accu
     in
-    let ry = ref (fun () -> assert false) in
-    let rec yield i () =
-      if i = !active
-      then
-        None
-      else
-        begin
-          ry := succ i |> yield;
-          Some ((i + tail) mod nsamples |> Array.get samples)
-        end
+      build 1 1 []
+  ;;
+
+  let latest = ref neg_infinity
+
+  (* Entry i also goes into the vertex arrays, twice: at i and at
+     i + size, so the newest `size' entries are always contiguous and
+     draw with a single call whatever the ring offset. Nothing else is
+     ever written to them, scrolling is left to the modelview matrix *)
+  let putverts l i t mean lo hi =
+    let x = t -. !timebase in
+    let bot, top = if !Args.poly then 0.0, mean else lo, hi in
+    let put j =
+      Raw.set_float l.lverts ~pos:(j * 2) x;
+      Raw.set_float l.lverts ~pos:(j * 2 + 1) mean;
+      Raw.set_float l.pverts ~pos:(j * 4) x;
+      Raw.set_float l.pverts ~pos:(j * 4 + 1) bot;
+      Raw.set_float l.pverts ~pos:(j * 4 + 2) x;
+      Raw.set_float l.pverts ~pos:(j * 4 + 3) top;
     in
-      ry := yield 0;
-      (fun () -> !ry ());
+      put i;
+      put (i + l.size)
+  ;;
+
+  let rec push k t mean lo hi =
+    if k < Array.length levels
+    then
+      let l = levels.(k) in
+        if !(l.pending) = 0
+        then
+          begin
+            l.amin := lo;
+            l.amax := hi
+          end
+        else
+          begin
+            l.amin := min !(l.amin) lo;
+            l.amax := max !(l.amax) hi
+          end
+        ;
+        l.tsum := !(l.tsum) +. t;
+        l.sum := !(l.sum) +. mean;
+        incr l.pending;
+        if !(l.pending) = l.step
+        then
+          let n = float l.step in
+          let t = !(l.tsum) /. n
+          and mean = !(l.sum) /. n
+          and lo = !(l.amin)
+          and hi = !(l.amax) in
+            putverts l !(l.head) t mean lo hi;
+            l.head := (succ !(l.head)) mod l.size;
+            l.active := min (succ !(l.active)) l.size;
+            l.pending := 0;
+            l.tsum := 0.0;
+            l.sum := 0.0;
+            push (succ k) t mean lo hi
+  ;;
+
+  (* coarsest level that still has an entry for every one of w pixels
+     (or the finest one kept) *)
+  let pick w =
+    let rec pick k =
+      if k = 0 || levels.(k).size >= w then levels.(k) else pick (pred k)
+    in
+      pick (Array.length levels - 1)
+  ;;
+
+  (* vertex arrays of level pick w *)
+  let getverts w =
+    let l = pick w in
+      { decimated = l.ratio > 1;
+        line = l.lverts;
+        pairs = l.pverts;
+        first = (!(l.head) - !(l.active) + l.size) mod l.size;
+        count = !(l.active);
+      }
   ;;
 
-  let update dt di =
-    let isamples = dt /. T.freq |> truncate in
+  let update t dt di =
     let l = 1.0 -. (di /. dt) in
     let l = max 0.0 l in
-      update l isamples;
+      if classify_float !timebase = FP_nan then timebase := t;
+      latest := t;
+      push 0 t l l l;
   ;;
 end
 
-module type ViewSampler =
-sig
-  val getyielder : unit -> unit -> float option
-  val update : float -> float -> float -> float -> unit
-end
-
 module type View =
 sig
   val x : int
@@ -677,6 +928,24 @@ sig
   val samplers : sampler list
 end
 
+(* A part of the window: display draws it inside the window area
+   rect () returns (x, y, w, h), reshape follows the window size, inc
+   is called once per tick and dirty is set whenever display would
+   draw something different *)
+type region =
+    { display : unit -> unit;
+      reshape : int -> int -> unit;
+      inc : unit -> unit;
+      rect : unit -> int * int * int * int;
+      dirty : bool ref;
+    }
+;;
+
+(* Drawing goes to the back buffer which is never swapped but copied
+   to the front, so it always holds the whole picture and a frame only
+   has to redraw (scissored) and copy the regions that are dirty.
+   Frames follow the data, but no more often than every -D seconds and
+   not at all while the window can not be seen *)
 module View (V: sig val w : int val h : int end) =
 struct
   let ww = ref 0
@@ -684,6 +953,10 @@ struct
   let oldwidth = ref !Args.w
   let barmode = ref false
   let funcs = ref []
+  let visible = ref true
+  let full = ref true
+  let posted = ref false
+  let last = ref 0.0
 
   let keyboard ~key ~x ~y =
     if key = 27 || key = Char.code 'q'
@@ -713,16 +986,80 @@ struct
     funcs := dri :: !funcs
   ;;
 
+  let dirty () = List.exists (fun r -> !(r.dirty)) !funcs
+
+  let copy (x, y, w, h) =
+    GlFunc.read_buffer `back;
+    GlFunc.draw_buffer `front;
+    GlDraw.viewport 0 0 !ww !wh;
+    GlMat.mode `projection;
+    GlMat.push ();
+    GlMat.load_identity ();
+    GlMat.mode `modelview;
+    GlMat.push ();
+    GlMat.load_identity ();
+    GlPix.raster_pos
+      ~x:(2.0 *. float x /. float !ww -. 1.0)
+      ~y:(2.0 *. float y /. float !wh -. 1.0) ();
+    GlPix.copy ~x ~y ~width:w ~height:h ~buffer:`color;
+    GlMat.pop ();
+    GlMat.mode `projection;
+    GlMat.pop ();
+    GlFunc.draw_buffer `back;
+  ;;
+
+  (* a display nobody asked for is an expose, everything is redrawn *)
   let display () =
-    GlClear.clear [`color];
-    List.iter (fun (display, _, _) -> display ()) !funcs;
-    Glut.swapBuffers ();
+    let all = !full || not (dirty ()) in
+    let regions = List.filter (fun r -> all || !(r.dirty)) !funcs in
+    let draw r =
+      if not all
+      then
+        begin
+          let x, y, w, h = r.rect () in
+            GlMisc.scissor ~x ~y ~width:w ~height:h;
+            GlClear.clear [`color];
+        end
+      ;
+      r.dirty := false;
+      r.display ()
+    in
+      posted := false;
+      full := false;
+      last := Unix.gettimeofday ();
+      if all
+      then
+        GlClear.clear [`color]
+      else
+        Gl.enable `scissor_test
+      ;
+      List.iter draw regions;
+      Gl.disable `scissor_test;
+      if all
+      then
+        copy (0, 0, !ww, !wh)
+      else
+        List.iter (fun r -> r.rect () |> copy) regions
+      ;
+      Gl.flush ();
+  ;;
+
+  let visibility ~state =
+    visible := state = Glut.VISIBLE;
+    if !visible
+    then
+      begin
+        full := true;
+        Glut.postRedisplay ()
+      end
   ;;
 
   let reshape ~w ~h =
     ww := w;
     wh := h;
-    List.iter (fun (_, reshape, _) -> reshape w h) !funcs;
+    full := true;
+    Text.reshape w h;
+    List.iter (fun r -> r.reshape w h) !funcs;
     GlClear.clear [`color];
     GlMat.mode `modelview;
     GlMat.load_identity ();
@@ -743,12 +1080,26 @@ struct
       Glut.displayFunc display;
       Glut.reshapeFunc reshape;
       Glut.keyboardFunc keyboard;
+      Glut.visibilityFunc visibility;
       GlDraw.color (1.0, 1.0, 0.0);
       winid;
   ;;
 
-  let inc () = List.iter (fun (_, _, inc) -> inc ()) !funcs
-  let update = Glut.postRedisplay
+  let inc () = List.iter (fun r -> r.inc ()) !funcs
+
+  let update () =
+    if !visible && not !posted && dirty ()
+    then
+      let wait = !last +. !Args.delay -. Unix.gettimeofday () in
+        posted := true;
+        if wait > 0.0
+        then
+          Glut.timerFunc ~ms:(wait *. 1000.0 |> ceil |> truncate)
+            ~cb:(fun ~value:_ -> Glut.postRedisplay ()) ~value:()
+        else
+          Glut.postRedisplay ()
+  ;;
+
   let func = Glut.idleFunc
   let run = Glut.mainLoop
 end
@@ -774,6 +1125,9 @@ struct
   let nrcpuscale = 1.0 /. float NP.nprocs
   let fh = 12
   let strw = Glut.bitmapLength ~font ~str:"55.55"
+  let text = Text.label 6
+  let shown = ref (-1)
+  let str = ref ""
   let sepsl =
     let base = GlList.gen_lists ~len:1 in
       GlList.nth base ~pos:0
@@ -840,24 +1194,19 @@ struct
     let load_all = min (1.0 -. load.all) 1.0 |> max 0.0 in
     let () = GlMat.push () in
     let () =
-      GlDraw.viewport !xoffset (I.y + 2) !w !h;
-      GlDraw.color (1.0, 1.0, 1.0);
-      let load_all = 100.0 *. load_all in
-      let str = sprintf "%5.2f" load_all in
-      let () =
-        GlMat.load_identity ();
-        let strw =
-          if false
-          then
-            Glut.bitmapLength ~font ~str:str
-          else
-            strw
-        in
-        let x = -. (float strw /. float !w) in
-          GlMat.translate ~y:~-.1.0 ~x ();
-      in
-      let () = draw_string 0.0 0.0 str in
-        ()
+      (* hundredths of a percent is all %5.2f shows *)
+      let v = 10000.0 *. load_all +. 0.5 |> truncate in
+      let x = !xoffset + (!w - strw) / 2 in
+        if v <> !shown
+        then
+          begin
+            shown := v;
+            str := sprintf "%5.2f" (float v /. 100.0)
+          end
+        ;
+        Text.set text x (I.y + 2) !str;
+        GlDraw.color (1.0, 1.0, 1.0);
+        Text.draw text;
     in
       GlDraw.viewport !xoffset (I.y + 15) !w (!h - 26);
       GlMat.load_identity ();
@@ -919,6 +1268,7 @@ struct
   let gscale = 1.0 /. float V.sgrid
   let nsamples = ref 0
   let dontdraw = ref false
+  let dirty = ref true
 
   let fw, fh =
     if !Args.labels
@@ -933,6 +1283,8 @@ struct
       GlList.nth base ~pos:0
   ;;
 
+  let texts = Array.init (100 / V.pgrid + 1) (fun _ -> Text.label 4)
+
   let getviewport typ =
     let ox = if !Args.scalebar then 0 else !Args.barw in
       match typ with
@@ -986,16 +1338,15 @@ struct
       if !Args.labels
       then
         begin
-          viewport `labels;
-          GlDraw.color (1.0, 1.0, 1.0);
-          let ohp = 100.0 in
-            for i = 0 to 100 / V.pgrid
-            do
-              let p = i * V.pgrid in
-              let y = float p /. ohp in
-              let s = sprintf "%3d%%" p in
-                draw_string 1.0 y s
-            done
+          let x, y, _, h = getviewport `labels in
+            GlDraw.color (1.0, 1.0, 1.0);
+            Array.iteri
+              (fun i text ->
+                let p = i * V.pgrid in
+                let y = y + p * h / 100 in
+                  Text.set text x y (sprintf "%3d%%" p);
+                  Text.draw text;
+              ) texts
         end
   ;;
 
@@ -1023,12 +1374,11 @@ struct
         end
   ;;
 
-  let swap =
-    Glut.swapBuffers |> oohz !Args.delay;
+  let inc () =
+    incr nsamples;
+    dirty := true
   ;;
 
-  let inc () = incr nsamples
-
   let mgrid () =
     GlDraw.line_width 1.0;
     GlDraw.color (0.0, !Args.grid_green, 0.0);
@@ -1049,39 +1399,52 @@ struct
     GlList.call gridlist;
     viewport `graph;
     if !Args.mgrid then mgrid ();
-    GlDraw.line_width 2.0;
+    let _, _, w, _ = getviewport `graph in
+    let now =
+      List.fold_left (fun t sampler -> max t (sampler.latest ())) neg_infinity
+        V.samplers
+    in
+    let draw shape raw first count =
+      GlArray.vertex `two raw;
+      GlArray.draw_arrays shape ~first ~count
+    in
+    let envelope sampler =
+      (* decimated levels also show the range every point stands for *)
+      let v = sampler.getverts w in
+        if v.decimated && v.count > 0
+        then
+          let r, g, b = sampler.color in
+            GlDraw.color (r *. 0.5, g *. 0.5, b *. 0.5);
+            draw `lines v.pairs (2 * v.first) (2 * v.count)
+    in
     let sample sampler =
-      GlDraw.color sampler.color;
-      let () =
-        if not !Args.poly
-        then GlDraw.begins `line_strip
-        else
+      let v = sampler.getverts w in
+        if v.count > 0
+        then
           begin
-            GlDraw.begins `polygon;
-            GlDraw.vertex2 (0.0, 0.0);
+            GlDraw.color sampler.color;
+            if !Args.poly
+            then
+              draw `quad_strip v.pairs (2 * v.first) (2 * v.count)
+            else
+              draw `line_strip v.line v.first v.count
           end
-      in
-      let yield = sampler.getyielder () in
-      let rec loop last i =
-        match yield () with
-          | Some y as opty ->
-              let x = scale *. float i in
-                GlDraw.vertex ~x ~y ();
-                loop opty (succ i)
-
-          | None ->
-              if !Args.poly
-              then
-                match last with
-                  | None -> ()
-                  | Some y ->
-                      let x = scale *. float (pred i) in
-                        GlDraw.vertex ~x ~y:0.0 ()
-      in
-        loop None 0;
-        GlDraw.ends ();
     in
+      (* vertices hold time - timebase, an entry at time t belongs at
+         x = 1 - (now - t) / interval *)
+      GlMat.mode `modelview;
+      GlMat.push ();
+      GlMat.translate ~x:1.0 ();
+      GlMat.scale ~x:(1.0 /. V.interval) ();
+      GlMat.translate ~x:(!timebase -. now) ();
+      GlArray.enable `vertex;
+      GlDraw.line_width 1.0;
+      if not !Args.poly then List.iter envelope V.samplers;
+      GlDraw.line_width 2.0;
       List.iter sample V.samplers;
+      GlArray.disable `vertex;
+      GlMat.pop ();
+      GlMat.mode `projection;
   ;;
 
   let display () =
@@ -1093,7 +1456,144 @@ struct
     ;
   ;;
 
-  let funcs = display, reshape, inc
+  let funcs =
+    { display = display
+    ; reshape = reshape
+    ; inc = inc
+    ; rect = (fun () -> !vx + ox, !vy, !vw, !vh)
+    ; dirty = dirty
+    }
+  ;;
+end
+
+(* All CPUs in one picture: a row per CPU, a column per sample and the
+   colour telling the load. The picture is a texture used as a ring, a
+   sample uploads only its own column and drawing is one quad whose
+   texture coordinates start at the oldest column (GL_REPEAT does the
+   wrap around), so the cost depends neither on the number of CPUs nor
+   on the history length. Histories longer than maxcols samples get
+   ratio samples averaged into a column *)
+module Heatmap (V : sig val nsamples : int end) =
+struct
+  let maxcols = 1024
+
+  let pow2 n =
+    let rec loop p = if p >= n then p else loop (p * 2) in
+      loop 1
+  ;;
+
+  let tw = min maxcols (pow2 V.nsamples)
+  let th = pow2 NP.nprocs
+  let ratio = (V.nsamples + tw - 1) / tw
+  (* the texture width is a power of two, only the newest cols columns
+     cover the history interval *)
+  let cols = (V.nsamples + ratio - 1) / ratio
+  let loads = Array.create NP.nprocs 0.0
+  let sums = Array.create NP.nprocs 0.0
+  let pending = ref 0
+  let head = ref 0
+  let vx = ref 0
+  let vw = ref 0
+  let vh = ref 0
+  let dirty = ref true
+  let column =
+    Bigarray.Array1.create Bigarray.int8_unsigned Bigarray.c_layout (th * 3)
+  ;;
+
+  let tex =
+    let tex = GlTex.gen_texture () in
+    let img = GlPix.create `ubyte ~format:`rgb ~width:tw ~height:th in
+    let raw = GlPix.to_raw img in
+      for i = 0 to tw * th * 3 - 1 do Raw.set raw ~pos:i 0 done;
+      Bigarray.Array1.fill column 0;
+      GlTex.bind_texture ~target:`texture_2d tex;
+      List.iter (GlTex.parameter ~target:`texture_2d)
+        [ `mag_filter `nearest
+        ; `min_filter `nearest
+        ; `wrap_s `repeat
+        ; `wrap_t `clamp
+        ];
+      GlPix.store (`unpack_alignment 1);
+      GlTex.image2d img;
+      tex
+  ;;
+
+  (* dark blue when idle, through red to yellow when busy *)
+  let color o l =
+    let l = max 0.0 (min 1.0 l) in
+    let b x = x *. 255.0 |> truncate in
+      column.{o} <- b (min 1.0 (2.0 *. l));
+      column.{o + 1} <- b (max 0.0 (2.0 *. l -. 1.0));
+      column.{o + 2} <- b (0.4 *. (1.0 -. l));
+  ;;
+
+  let update i _ dt di =
+    loads.(i) <- 1.0 -. (di /. dt)
+  ;;
+
+  let inc () =
+    for i = 0 to NP.nprocs - 1 do sums.(i) <- sums.(i) +. loads.(i) done;
+    incr pending;
+    if !pending = ratio
+    then
+      begin
+        for i = 0 to NP.nprocs - 1 do
+          color (i * 3) (sums.(i) /. float ratio);
+          sums.(i) <- 0.0
+        done;
+        GlTex.bind_texture ~target:`texture_2d tex;
+        NP.tex_column !head column;
+        head := (succ !head) mod tw;
+        pending := 0;
+        dirty := true
+      end
+  ;;
+
+  let reshape w h =
+    let x =
+      if !Args.scalebar
+      then
+        float (w * !Args.barw) /. float !Args.w |> truncate
+      else
+        !Args.barw
+    in
+      vx := x + 5;
+      vw := w - x - 10;
+      vh := h - 10;
+  ;;
+
+  let display () =
+    if !vw > 0 && !vh > 0
+    then
+      let s = float (!head - cols) /. float tw
+      and e = float !head /. float tw
+      and t = float NP.nprocs /. float th in
+        GlDraw.viewport !vx 5 !vw !vh;
+        GlDraw.color (1.0, 1.0, 1.0);
+        Gl.enable `texture_2d;
+        GlTex.bind_texture ~target:`texture_2d tex;
+        GlTex.env (`mode `replace);
+        GlDraw.begins `quads;
+        GlTex.coord2 (s, 0.0);
+        GlDraw.vertex2 (0.0, 0.0);
+        GlTex.coord2 (e, 0.0);
+        GlDraw.vertex2 (1.0, 0.0);
+        GlTex.coord2 (e, t);
+        GlDraw.vertex2 (1.0, 1.0);
+        GlTex.coord2 (s, t);
+        GlDraw.vertex2 (0.0, 1.0);
+        GlDraw.ends ();
+        Gl.disable `texture_2d;
+  ;;
+
+  let funcs =
+    { display = display
+    ; reshape = reshape
+    ; inc = inc
+    ; rect = (fun () -> !vx, 5, !vw, !vh)
+    ; dirty = dirty
+    }
+  ;;
 end
 
 let getplacements w h n barw =
@@ -1125,7 +1625,437 @@ let getplacements w h n barw =
     loop [] 0, vw, vh
 ;;
 
-let create fd w h =
+(* Recording: a file of fixed size records of native float64s, each
+   laid out like a sampler ring slot (ticks covered, idle before/after,
+   stat before/after, idle times, /proc/stat rows). Record 0 is the
+   header (magic, version, nprocs, idle times and stat rows per record,
+   record size, sampling period), later records are only ever appended
+   so a torn last record is simply ignored. Since every record sits at
+   a fixed offset and timestamps grow, the file is its own time index:
+   it is mapped with Bigarray.map_file and seeking is a binary search
+   that touches log2(n) pages, nothing is parsed *)
+module Record =
+struct
+  let magic = 1095779154.0              (* "APCR" *)
+  let version = 1.0
+  let hdrfields = 7
+
+  let stride nidle rows = max hdrfields (5 + nidle + rows * NP.nfields)
+
+  type t =
+      { data : (float, Bigarray.float64_elt, Bigarray.c_layout)
+            Bigarray.Array2.t;
+        nrecords : int;
+        nidle : int;
+        rows : int;
+        period : float;
+      }
+  ;;
+
+  let header nidle rows =
+    let stride = stride nidle rows in
+    let h = Bigarray.Array1.create Bigarray.float64 Bigarray.c_layout stride in
+      Bigarray.Array1.fill h 0.0;
+      h.{0} <- magic;
+      h.{1} <- version;
+      h.{2} <- float NP.nprocs;
+      h.{3} <- float nidle;
+      h.{4} <- float rows;
+      h.{5} <- float stride;
+      h.{6} <- !Args.freq;
+      h
+  ;;
+
+  let check path h =
+    let fail s = failwith (sprintf "%s: %s" path s) in
+      if h.{0} <> magic then fail "not an apc recording";
+      if h.{1} <> version then fail "unsupported recording version";
+      if truncate h.{2} <> NP.nprocs
+      then
+        sprintf "recorded on %d CPUs, this machine has %d"
+          (truncate h.{2}) NP.nprocs |> fail
+  ;;
+
+  (* appends to path (creating it with a header) records of nidle idle
+     times and rows stat rows, returns the file and the record buffer *)
+  let create path nidle rows =
+    let fd =
+      Unix.openfile path [Unix.O_RDWR; Unix.O_CREAT; Unix.O_APPEND] 0o644
+    in
+    let h = header nidle rows in
+    let size = (Unix.fstat fd).Unix.st_size in
+    let () =
+      if size = 0
+      then
+        NP.write_floats fd h
+      else
+        let old =
+          Bigarray.Array1.map_file fd Bigarray.float64 Bigarray.c_layout
+            false hdrfields
+        in
+          check path old;
+          if Bigarray.Array1.sub old 0 hdrfields
+            <> Bigarray.Array1.sub h 0 hdrfields
+          then
+            failwith (path ^ ": recorded with different settings")
+          ;
+          (* drop a torn last record *)
+          let stride = Bigarray.Array1.dim h * 8 in
+            Unix.ftruncate fd (size / stride * stride)
+    in
+      fd, Bigarray.Array1.create Bigarray.float64 Bigarray.c_layout
+        (Bigarray.Array1.dim h)
+  ;;
+
+  let openfile path =
+    let fd = Unix.openfile path [Unix.O_RDONLY] 0 in
+    let h =
+      Bigarray.Array1.map_file fd Bigarray.float64 Bigarray.c_layout
+        false hdrfields
+    in
+    let () = check path h in
+    let stride = truncate h.{5} in
+    let n = (Unix.fstat fd).Unix.st_size / (stride * 8) in
+    let data =
+      Bigarray.Array2.map_file fd Bigarray.float64 Bigarray.c_layout
+        false n stride
+    in
+      Unix.close fd;
+      { data = data;
+        nrecords = n - 1;
+        nidle = truncate h.{3};
+        rows = truncate h.{4};
+        period = h.{6};
+      }
+  ;;
+
+  (* time of record n (1 based) as used by sources, see there *)
+  let time r n =
+    let o = if r.rows > 0 then 3 else 1 in
+      (r.data.{n, o} +. r.data.{n, o + 1}) *. 0.5
+  ;;
+
+  (* first record at or after t *)
+  let seek r t =
+    let rec bisect lo hi =
+      if lo >= hi
+      then
+        lo
+      else
+        let mid = (lo + hi) / 2 in
+          if time r mid < t
+          then bisect (mid + 1) hi
+          else bisect lo mid
+    in
+      bisect 1 r.nrecords
+  ;;
+end
+
+type feed =
+    | Live of NP.idlesrc
+    | Replay of string
+    | Attach of string
+;;
+
+type sources =
+    { sample : float -> int;
+      current : unit -> int;
+      time : int -> float;
+      kdt : int -> float;
+      idt : int -> float;
+      kcalc : int -> int -> float -> stats;
+      icalc : int -> int -> float -> stats;
+    }
+;;
+
+(* Counter sources shared by the windowed and the headless mode: the
+   samplers' buffers and, per CPU, the functions turning the current
+   sample (and dt) into stats *)
+let sources feed =
+  let replay =
+    match feed with
+      | Replay path ->
+          let r = Record.openfile path in
+            if r.Record.nrecords = 0 then failwith (path ^ ": no records");
+            Args.isampler := r.Record.nidle > 0;
+            Args.ksampler := r.Record.rows > 0;
+            Args.freq := r.Record.period;
+            Args.gzh := false;
+            Args.uptime := false;
+            Some r
+      | Attach name ->
+          let nidle, rows, period = NP.shm_attach name in
+            Args.isampler := nidle > 0;
+            Args.ksampler := rows > 0;
+            Args.freq := period;
+            Args.gzh := false;
+            Args.uptime := false;
+            None
+      | Live _ -> None
+  in
+  let newbuf n =
+    let b = Bigarray.Array1.create Bigarray.float64 Bigarray.c_layout n in
+      Bigarray.Array1.fill b 0.0;
+      b
+  in
+  (* two sets of idle times and timestamps (before/after the idle read,
+     before/after the /proc/stat read), every sample goes into the set
+     holding the oldest values so that the previous sample is still
+     around for the differences and nothing is allocated per sample *)
+  let ibufs =
+    Array.init 2 (fun _ -> newbuf (if !Args.isampler then NP.nprocs else 0))
+  in
+  let tbufs = Array.init 2 (fun _ -> newbuf 4) in
+
+  let kget = NP.parse_stat () in
+  let ks = kget () in
+  let kbuf = if !Args.ksampler then ks else newbuf 0 in
+  let nidle = Bigarray.Array1.dim ibufs.(0)
+  and rows = Bigarray.Array1.dim kbuf / NP.nfields in
+
+  let snapshot src =
+    if NP.linux
+    then
+      NP.snapshot src
+    else
+      fun ibuf kbuf ts ->
+        ts.{0} <- Unix.gettimeofday ();
+        if Bigarray.Array1.dim ibuf > 0
+        then
+          (* gross hack but we are not particularly picky today *)
+          Array.iteri (fun i v -> ibuf.{i} <- v)
+            (NP.idletimeofday Unix.stdout NP.nprocs)
+        ;
+        ts.{1} <- Unix.gettimeofday ();
+        ts.{2} <- ts.{1};
+        if Bigarray.Array1.dim kbuf > 0 then ignore (kget ());
+        ts.{3} <- Unix.gettimeofday ()
+  in
+  (* record n of a replay into set c, returns the ticks it covers *)
+  let load r n c =
+    let row = Bigarray.Array2.slice_left r.Record.data n in
+      Bigarray.Array1.blit (Bigarray.Array1.sub row 1 4) tbufs.(c);
+      Bigarray.Array1.blit (Bigarray.Array1.sub row 5 nidle) ibufs.(c);
+      Bigarray.Array1.blit
+        (Bigarray.Array1.sub row (5 + nidle) (rows * NP.nfields)) kbuf;
+      row.{0}
+  in
+  let cur = ref 0 in
+  let next = ref 0 in
+  let total = ref 0.0 in
+  let () =
+    begin match feed, replay with
+      | Replay _, Some r ->
+          next := Record.seek r (Record.time r 1 +. !Args.seek);
+          if !next > r.Record.nrecords
+          then
+            failwith "seek position is past the end of the recording"
+          ;
+          ignore (load r !next 0);
+          incr next
+      | Live src, _ -> snapshot src ibufs.(0) kbuf tbufs.(0)
+      | Attach name, _ ->
+          total := NP.shm_latest ibufs.(0) kbuf tbufs.(0);
+          if !total = 0.0 then failwith (name ^ ": nothing published yet")
+      | Replay _, None -> assert false
+    end;
+    Bigarray.Array1.blit ibufs.(0) ibufs.(1);
+    Bigarray.Array1.blit tbufs.(0) tbufs.(1)
+  in
+  (* waits up to timeout seconds for the next sample, returns the
+     number of ticks it covers (0 if there is none yet) and makes it
+     the current set. On Linux samples are taken by a thread of its own
+     so that slow frames do not delay them, elsewhere right here. A
+     replay hands out records at the recorded period divided by -speed
+     and skips to the latest due one if rendering falls behind. When
+     attached to a -publish-ing apc the latest sample it published is
+     copied out of shared memory once per period, its total tick count
+     tells how many ticks passed since the previous one *)
+  let sample =
+    match feed, replay with
+      | Replay _, Some r ->
+          let () = Ticker.start (r.Record.period /. !Args.speed) in
+            fun timeout ->
+              let n = Ticker.wait timeout in
+              let n = min n (r.Record.nrecords + 1 - !next) in
+                if n <= 0
+                then
+                  0
+                else
+                  let ticks = ref 0.0 in
+                  let c = 1 - !cur in
+                    for k = !next to !next + n - 1 do
+                      ticks := !ticks +. r.Record.data.{k, 0}
+                    done;
+                    ignore (load r (!next + n - 1) c);
+                    cur := c;
+                    next := !next + n;
+                    truncate !ticks
+
+      | Replay _, None -> assert false
+
+      | Attach _, _ ->
+          let () = Ticker.start !Args.freq in
+            fun timeout ->
+              if Ticker.wait timeout = 0
+              then
+                0
+              else
+                let c = 1 - !cur in
+                let t = NP.shm_latest ibufs.(c) kbuf tbufs.(c) in
+                let ticks = t -. !total |> truncate in
+                  if ticks > 0
+                  then
+                    begin
+                      cur := c;
+                      total := t
+                    end
+                  ;
+                  ticks
+
+      | Live src, _ when NP.linux ->
+          if !Args.publish <> ""
+          then
+            NP.shm_publish !Args.publish nidle rows !Args.freq
+          ;
+          NP.sampler_start src nidle rows !Args.freq !Args.pin;
+          fun timeout ->
+            let c = 1 - !cur in
+            let ticks = NP.sampler_next timeout ibufs.(c) kbuf tbufs.(c) in
+              if ticks > 0 then cur := c;
+              ticks
+
+      | Live src, _ ->
+          let () = Ticker.start !Args.freq in
+          let snapshot = snapshot src in
+            fun timeout ->
+              let ticks = Ticker.wait timeout in
+                if ticks > 0
+                then
+                  begin
+                    cur := 1 - !cur;
+                    snapshot ibufs.(!cur) kbuf tbufs.(!cur)
+                  end
+                ;
+                ticks
+  in
+  let sample =
+    if !Args.record = "" || replay <> None
+    then
+      sample
+    else
+      let fd, rbuf = Record.create !Args.record nidle rows in
+      let rts = Bigarray.Array1.sub rbuf 1 4
+      and ris = Bigarray.Array1.sub rbuf 5 nidle
+      and rks = Bigarray.Array1.sub rbuf (5 + nidle) (rows * NP.nfields) in
+        fun timeout ->
+          let ticks = sample timeout in
+            if ticks > 0
+            then
+              begin
+                rbuf.{0} <- float ticks;
+                Bigarray.Array1.blit tbufs.(!cur) rts;
+                Bigarray.Array1.blit ibufs.(!cur) ris;
+                Bigarray.Array1.blit kbuf rks;
+                NP.write_floats fd rbuf
+              end
+            ;
+            ticks
+  in
+  (* time between the midpoints of the reads of a source *)
+  let srcdt o c =
+    let mid c = (tbufs.(c).{o} +. tbufs.(c).{o + 1}) *. 0.5 in
+      mid c -. mid (1 - c)
+  in
+
+  let kcalc i =
+    if !Args.gzh
+    then
+      let d = ref 0.0 in
+      let f d' = d := d' in
+      let () = Gzh.gen f in
+        fun _ _ ->
+          let d = !d in
+            { zero_stat with
+              all = d; iowait = d; user = 1.0 -. d; idle = d }
+    else
+      if !Args.uptime
+      then
+        let (u1, i1) = NP.parse_uptime () in
+        let u1 = ref u1
+        and i1 = ref i1 in
+          fun _ _ ->
+            let (u2, i2) = NP.parse_uptime () in
+            let du = u2 -. !u1
+            and di = i2 -. !i1 in
+            let d = di /. du in
+              u1 := u2;
+              i1 := i2;
+              { zero_stat with
+                all = d; iowait = d; user = 1.0 -. d; idle = d }
+    else
+      let i' = if i = NP.nprocs then 0 else succ i in
+      let g ks n = ks.{i' * NP.nfields + n} in
+      let gall ks =
+        let user = g ks NP.user
+        and nice = g ks NP.nice
+        and sys = g ks NP.sys
+        and idle = g ks NP.idle
+        and iowait = g ks NP.idle
+        and intr = g ks NP.intr
+        and softirq = g ks NP.softirq in
+        let () =
+          if !Args.debug
+          then
+            eprintf
+              "user=%f nice=%f sys=%f iowait=%f intr=%f softirq=%f@."
+              user
+              nice
+              sys
+              iowait
+              intr
+              softirq
+          ;
+        in
+          { all = user +. nice +. sys
+          ; user = user
+          ; nice = nice
+          ; sys = sys
+          ; idle = idle
+          ; iowait = iowait
+          ; intr = intr
+          ; softirq = softirq
+          }
+      in
+      let i1 = ref (gall ks) in
+        fun _ dt ->
+          let i2 = gall ks in
+          let diff = add_stat i2 (neg_stat !i1) in
+          let diff = { diff with all = dt -. diff.all } in
+            i1 := i2;
+            diff
+  in
+  let icalc i c dt =
+    let i2 = ibufs.(c).{i} in
+      if classify_float i2 = FP_infinite
+      then
+        { zero_stat with all = dt }
+      else
+        { zero_stat with all = i2 -. ibufs.(1 - c).{i} }
+  in
+    { sample = sample;
+      current = (fun () -> !cur);
+      time = (fun c ->
+        let o = if !Args.ksampler then 2 else 0 in
+          (tbufs.(c).{o} +. tbufs.(c).{o + 1}) *. 0.5);
+      kdt = srcdt 2;
+      idt = srcdt 0;
+      kcalc = kcalc;
+      icalc = icalc;
+    }
+;;
+
+let create srcs w h =
   let module S =
       struct
         let freq = !Args.freq
@@ -1134,35 +2064,27 @@ let create fd w h =
   in
   let placements, vw, vh = getplacements w h NP.nprocs !Args.barw in
 
-  let iget () =
-    if !Args.isampler then NP.idletimeofday fd NP.nprocs else [||]
-  in
-  let is = iget () in
-
-  let kget () =
-    let gks = NP.parse_stat () in
-      gks () |> Array.of_list
-  in
-  let ks = kget () in
-
   let crgraph (kaccu, iaccu, gaccu) (i, x, y) =
     let module Si = Sampler (S) in
     let isampler =
-      { getyielder = Si.getyielder
+      { getverts = Si.getverts
+      ; latest = (fun () -> !Si.latest)
       ; color = (1.0, 1.0, 0.0)
       ; update = Si.update
       }
     in
     let module Sk = Sampler (S) in
     let ksampler =
-      { getyielder = Sk.getyielder
+      { getverts = Sk.getverts
+      ; latest = (fun () -> !Sk.latest)
       ; color = (1.0, 0.0, 0.0)
       ; update = Sk.update
       }
     in
     let module Sk2 = Sampler (S) in
     let ksampler2 =
-      { getyielder = Sk2.getyielder
+      { getverts = Sk2.getverts
+      ; latest = (fun () -> !Sk2.latest)
       ; color = (1.0, 1.0, 1.0)
       ; update = Sk2.update
       }
@@ -1189,86 +2111,20 @@ let create fd w h =
     let kaccu =
       if !Args.ksampler
       then
-        let calc =
-          if !Args.gzh
-          then
-            let d = ref 0.0 in
-            let f d' = d := d' in
-            let () = Gzh.gen f in
-              fun _ _ _ ->
-                let d = !d in
-                  { zero_stat with
-                    all = d; iowait = d; user = 1.0 -. d; idle = d }
-          else
-            if !Args.uptime
-            then
-              let (u1, i1) = NP.parse_uptime () in
-              let u1 = ref u1
-              and i1 = ref i1 in
-                fun _ _ _ ->
-                  let (u2, i2) = NP.parse_uptime () in
-                  let du = u2 -. !u1
-                  and di = i2 -. !i1 in
-                  let d = di /. du in
-                    u1 := u2;
-                    i1 := i2;
-                    { zero_stat with
-                      all = d; iowait = d; user = 1.0 -. d; idle = d }
-          else
-            let i' = if i = NP.nprocs then 0 else succ i in
-            let g ks n = Array.get ks i' |> snd |> Array.get |< n in
-            let gall ks =
-              let user = g ks NP.user
-              and nice = g ks NP.nice
-              and sys = g ks NP.sys
-              and idle = g ks NP.idle
-              and iowait = g ks NP.idle
-              and intr = g ks NP.intr
-              and softirq = g ks NP.softirq in
-              let () =
-                if !Args.debug
-                then
-                  eprintf
-                    "user=%f nice=%f sys=%f iowait=%f intr=%f softirq=%f@."
-                    user
-                    nice
-                    sys
-                    iowait
-                    intr
-                    softirq
-                ;
-              in
-                { all = user +. nice +. sys
-                ; user = user
-                ; nice = nice
-                ; sys = sys
-                ; idle = idle
-                ; iowait = iowait
-                ; intr = intr
-                ; softirq = softirq
-                }
-            in
-            let i1 = ref (gall ks) in
-              fun ks t1 t2 ->
-                let i2 = gall ks in
-                let diff = add_stat i2 (neg_stat !i1) in
-                let diff = { diff with all = t2 -. t1 -. diff.all } in
-                  i1 := i2;
-                  diff
-        in
+        let calc = srcs.kcalc i in
         let calc2 =
           let idle1 = ref 0.0 in
           fun ks (t1 : float) (t2 : float) ->
             let i' = if i = NP.nprocs then 0 else succ i in
-            let g ks n = Array.get ks i' |> snd |> Array.get |< n in
+            let g ks n = ks.{i' * NP.nfields + n} in
             let idle2 = g ks NP.idle in
             let diff = idle2 -. !idle1 in
             let diff = { zero_stat with all = diff } in
             idle1 := idle2;
             diff
         in
-        (i, calc, ksampler)
-        (* :: (i, calc2, ksampler2) *)
+        (i, calc, ksampler.update)
+        (* :: (i, calc2, ksampler2.update) *)
         :: kaccu
       else
         kaccu
@@ -1276,34 +2132,53 @@ let create fd w h =
     let iaccu =
       if !Args.isampler
       then
-        let calc =
-          let i1 = Array.get is i |> ref in
-            fun is t1 t2 ->
-              let i2 = Array.get is i in
-                if classify_float i2 = FP_infinite
-                then
-                  { zero_stat with all = t2 -. t1 }
-                else
-                  let i1' = !i1 in
-                    i1 := i2;
-                    { zero_stat with all = i2 -. i1' }
-        in
-          (i, calc, isampler) :: iaccu
+        let calc = srcs.icalc i in
+          (i, calc, isampler.update) :: iaccu
       else
         iaccu
     in
       kaccu, iaccu, Graph.funcs :: gaccu
   in
+  if !Args.heatmap
+  then
+    let module H = Heatmap (S) in
+    (* the heatmap shows the idle sampler if there is one *)
+    let rec funcs calc hm i accu =
+      if i < 0
+      then
+        accu
+      else
+        let update = if hm then H.update i else fun _ _ _ -> () in
+          (i, calc i, update) :: accu |> funcs calc hm (pred i)
+    in
+    let n = NP.nprocs - 1 in
+    let kl =
+      if !Args.ksampler then funcs srcs.kcalc (not !Args.isampler) n [] else []
+    and il = if !Args.isampler then funcs srcs.icalc true n [] else [] in
+      kl, il, [H.funcs]
+  else
   let kl, il, gl = List.fold_left crgraph ([], [], []) placements in
-    ((if kl == [] then (fun () -> [||]) else kget), kl), (iget, il), gl
+    kl, il, gl
 ;;
 
 let opendev path =
   if not NP.linux
   then
-    (* gross hack but we are not particularly picky today *)
-    Unix.stdout
+    NP.Itc Unix.stdout
   else
+    if !Args.cpuidle
+    then
+      begin
+        if not (NP.cpuidle_open NP.nprocs)
+        then
+          begin
+            eprintf "cpuidle residency counters are not available@.";
+            exit 100
+          end
+        ;
+        NP.Cpuidle
+      end
+    else
     try
       if (Unix.stat path).Unix.st_kind != Unix.S_CHR
       then
@@ -1312,20 +2187,24 @@ let opendev path =
           exit 100
         end
       ;
-      Unix.openfile path [Unix.O_RDONLY] 0
+      let fd = Unix.openfile path [Unix.O_RDONLY] 0 in
+        NP.Itc fd
     with
+      | Unix.Unix_error ((Unix.ENOENT | Unix.ENODEV | Unix.ENXIO), _, _)
+          when NP.cpuidle_open NP.nprocs ->
+          (* modern kernels have nothing the module could hook *)
+          if !Args.verbose
+          then
+            eprintf "ITC device %S is not available, using cpuidle@." path
+          ;
+          NP.Cpuidle
+
       | Unix.Unix_error ((Unix.ENODEV | Unix.ENXIO) as err , s1, s2) ->
           eprintf "Could not open ITC device %S:\n%s(%s): %s@."
             path s1 s2 |< Unix.error_message err;
           eprintf "(perhaps the module is not loaded?)@.";
           exit 100
 
-      | Unix.Unix_error (Unix.EALREADY, s1, s2) ->
-          eprintf "Could not open ITC device %S:\n%s(%s): %s@."
-            path s1 s2 |< Unix.error_message Unix.EALREADY;
-          eprintf "(perhaps modules is already in use?)@.";
-          exit 100
-
       | Unix.Unix_error (error, s1, s2) ->
           eprintf "Could not open ITC device %S:\n%s(%s): %s@."
             path s1 s2 |< Unix.error_message error;
@@ -1337,62 +2216,31 @@ let opendev path =
           exit 100
 ;;
 
+(* The icon is a column of 32 rows, so only the row counts matter:
+   the property is replaced when they change and then no more often than
+   every -D seconds, in between changes wait for a later tick *)
 let seticon () =
   let module X =
       struct
-        external seticon : string -> unit = "ml_seticon"
+        external seticon : int -> int -> unit = "ml_seticon"
       end
   in
-  let len = 32*4 in
-  let data = String.create |< 32*len + 2*4 in
-  let line r g b a =
-    let r = Char.chr r
-    and g = Char.chr g
-    and b = Char.chr b
-    and a = Char.chr a in
-    let s = String.create len in
-    let rec fill x =
-      if x = len
-      then
-        s
-      else
-        begin
-          x + 0 |> String.set s |< b;
-          x + 1 |> String.set s |< g;
-          x + 2 |> String.set s |< r;
-          x + 3 |> String.set s |< a;
-          x + 4 |> fill
-        end
-    in
-      fill 0
-  in
-  let el = line 0x00 0x00 0x00 0xff
-  and kl = line 0xff 0x00 0x00 0xff
-  and il = line 0xff 0xff 0x00 0xff in
-  let fill l sy ey =
-    let src = l and dst = data and src_pos = 0 in
-    let rec loop n dst_pos =
-      if n > 0
-      then
-        begin
-          StringLabels.blit ~src ~src_pos ~dst ~dst_pos ~len;
-          pred n |> loop |< dst_pos + len
-        end
-    in
-      (ey - sy) |> loop |< (32 - ey) * len + 4*2
-  in
+  let shown = ref (-1, -1) in
+  let last = ref neg_infinity in
     fun ~iload ~kload ->
       let iy = iload *. 32.0 |> ceil |> truncate |> max 0 |> min 32
       and ky = kload *. 32.0 |> ceil |> truncate |> max 0 |> min 32 in
-      let ey =
-        if ky < iy
+      let rows = ky, max ky iy in
+        if rows <> !shown
         then
-          (fill kl 0 ky; fill il ky iy; iy)
-        else
-          (fill kl 0 ky; ky)
-      in
-        fill el ey 32;
-        X.seticon data;
+          let now = Unix.gettimeofday () in
+            if now -. !last >= !Args.delay
+            then
+              begin
+                X.seticon ky iy;
+                shown := rows;
+                last := now;
+              end
 ;;
 
 let create_bars h kactive iactive =
@@ -1459,23 +2307,114 @@ let create_bars h kactive iactive =
       then
         let d () = kd (); id () in
         let r w h = kr w h; ir w h in
-        let u d k i = ku d k; iu d i in
+        let u dk k di i = ku dk k; iu di i in
           d, r, u
       else
-        kd, kr, (fun d k _ -> ku d k)
+        kd, kr, (fun dk k _ _ -> ku dk k)
       end
     else
       begin
         if iactive
         then
-          id, ir, (fun d _ i -> iu d i)
+          id, ir, (fun _ _ di i -> iu di i)
         else
-          (fun () -> ()), (fun _ _ -> ()), (fun _ _ _ -> ())
+          (fun () -> ()), (fun _ _ -> ()), (fun _ _ _ _ -> ())
       end
 ;;
 
+(* One record per CPU and sample: monotonic time in seconds, CPU,
+   ticks covered, idle sampler load, kernel sampler load and its
+   user/nice/sys/idle/iowait/intr/softirq fractions (NaN for disabled
+   samplers). CSV with a header line or, with -binary, HFIELDS native
+   float64s per record. Nothing but the samplers runs, so per tick the
+   cost is the snapshot plus formatting nprocs records *)
+let hfields = 12
+
+let headless srcs =
+  if !Args.outpath = ""
+  then
+    (* just keeping the sampler thread going for -publish *)
+    let rec loop () = ignore (srcs.sample 1.0); loop () in
+      loop ()
+  else
+  let fd =
+    if !Args.outpath = "-"
+    then
+      Unix.stdout
+    else
+      Unix.openfile !Args.outpath
+        [Unix.O_WRONLY; Unix.O_CREAT; Unix.O_TRUNC] 0o644
+  in
+  let ch = Unix.out_channel_of_descr fd in
+  let kl = if !Args.ksampler then Array.init NP.nprocs srcs.kcalc else [||]
+  and il = if !Args.isampler then Array.init NP.nprocs srcs.icalc else [||] in
+  let out =
+    Bigarray.Array1.create Bigarray.float64 Bigarray.c_layout
+      (NP.nprocs * hfields)
+  in
+  let record c ticks i =
+    let o = i * hfields in
+    let di = srcs.idt c
+    and dk = srcs.kdt c in
+      out.{o + 0} <- srcs.time c;
+      out.{o + 1} <- float i;
+      out.{o + 2} <- float ticks;
+      out.{o + 3} <-
+        if Array.length il = 0
+        then nan
+        else 1.0 -. (il.(i) c di).all /. di
+      ;
+      if Array.length kl = 0
+      then
+        Bigarray.Array1.fill (Bigarray.Array1.sub out (o + 4) 8) nan
+      else
+        let k = scale_stat (kl.(i) c dk) (1.0 /. dk) in
+          out.{o + 4} <- 1.0 -. k.all;
+          out.{o + 5} <- k.user;
+          out.{o + 6} <- k.nice;
+          out.{o + 7} <- k.sys;
+          out.{o + 8} <- k.idle;
+          out.{o + 9} <- k.iowait;
+          out.{o + 10} <- k.intr;
+          out.{o + 11} <- k.softirq;
+  in
+  let csv i =
+    let o = i * hfields in
+    let g n = out.{o + n} in
+      Printf.fprintf ch
+        "%.6f,%d,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n"
+        (g 0) i (g 2 |> truncate) (g 3) (g 4) (g 5) (g 6) (g 7) (g 8)
+        (g 9) (g 10) (g 11)
+  in
+  let () =
+    if not !Args.binary
+    then
+      output_string ch
+        "time,cpu,ticks,iload,kload,user,nice,sys,idle,iowait,intr,softirq\n"
+  in
+  let rec loop () =
+    let ticks = srcs.sample 1.0 in
+      if ticks > 0
+      then
+        begin
+          let c = srcs.current () in
+            for i = 0 to NP.nprocs - 1 do record c ticks i done;
+            if !Args.binary
+            then
+              NP.write_floats fd out
+            else
+              begin
+                for i = 0 to NP.nprocs - 1 do csv i done;
+                flush ch
+              end
+        end
+      ;
+      loop ()
+  in
+    loop ()
+;;
+
 let main () =
-  let _ = Glut.init [|""|] in
   let () = Args.init () in
   let () =
     if !Args.verbose
@@ -1483,15 +2422,27 @@ let main () =
       "detected " ^ string_of_int NP.nprocs ^ " CPUs" |> print_endline
   in
   let () = if !Args.gzh then Gzh.init !Args.verbose else () in
-  let () = Delay.init !Args.timer !Args.gzh in
   let () = if !Args.niceval != 0 then NP.setnice !Args.niceval else () in
+  let feed =
+    if !Args.replay <> ""
+    then Replay !Args.replay
+    else
+      if !Args.attach <> ""
+      then Attach !Args.attach
+      else Live (opendev !Args.devpath)
+  in
+  if !Args.headless
+  then
+    sources feed |> headless
+  else
+  let _ = Glut.init [|""|] in
   let w = !Args.w
   and h = !Args.h in
-  let fd = opendev !Args.devpath in
   let module FullV = View (struct let w = w let h = h end) in
   let winid = FullV.init () in
   let () = NP.fixwindow winid in
-  let (kget, kfuncs), (iget, ifuncs), gl = create fd w h in
+  let srcs = sources feed in
+  let kfuncs, ifuncs, gl = create srcs w h in
   let bar_update =
     List.iter FullV.add gl;
     if !Args.barw > 0
@@ -1499,23 +2450,42 @@ let main () =
       let (display, reshape, update) =
         create_bars h !Args.ksampler !Args.isampler
       in
-        FullV.add (display, reshape, fun _ -> ());
-        update
+      let dirty = ref true
+      and bw = ref !Args.barw
+      and bh = ref h in
+        FullV.add
+          { display = display
+          ; reshape = (fun w h ->
+              if !Args.scalebar then bw := w * !Args.barw / !Args.w;
+              bh := h;
+              reshape w h)
+          ; inc = (fun () -> ())
+          ; rect = (fun () -> 0, 0, !bw, !bh)
+          ; dirty = dirty
+          };
+        fun dk k di i ->
+          dirty := true;
+          update dk k di i
     else
-      fun _ _ _ -> ()
+      fun _ _ _ _ -> ()
   in
   let seticon = if !Args.icon then seticon () else fun ~iload ~kload -> () in
-  let rec loop t1 () =
-    let t2 = Unix.gettimeofday () in
-    let dt = t2 -. t1 in
-      if dt >= !Args.freq
+  let timeout = 1.0 /. float !Args.timer in
+  let loop () =
+    let ticks = srcs.sample timeout in
+      if ticks > 0
       then
-        let is = iget () in
-        let ks = kget () in
-        let rec loop2 load sample = function
+        let () =
+          if ticks > 1 && !Args.verbose
+          then
+            eprintf "missed %d ticks@." (ticks - 1)
+        in
+        let c = srcs.current () in
+        let now = srcs.time c in
+        let rec loop2 load dt = function
           | [] -> load
-          | (nr, calc, sampler) :: rest ->
-              let cpuload = calc sample t1 t2 in
+          | (nr, calc, update) :: rest ->
+              let cpuload = calc c dt in
               let () =
                 let thisload = 1.0 -. (cpuload.all /. dt) in
                 let thisload = max 0.0 thisload in
@@ -1526,11 +2496,13 @@ let main () =
                   |> print_endline)
               in
               let load = add_stat load cpuload in
-                sampler.update dt cpuload.all;
-                loop2 load sample rest
+                update now dt cpuload.all;
+                loop2 load dt rest
         in
-        let iload = loop2 zero_stat is ifuncs in
-        let kload = loop2 zero_stat ks kfuncs in
+        let di = srcs.idt c
+        and dk = srcs.kdt c in
+        let iload = loop2 zero_stat di ifuncs in
+        let kload = loop2 zero_stat dk kfuncs in
           if !Args.debug
           then
             begin
@@ -1539,14 +2511,11 @@ let main () =
             end
           ;
           seticon ~iload:iload.all ~kload:kload.all;
-          bar_update dt kload iload;
-          FullV.inc ();
-          FullV.update ();
-          FullV.func (Some (loop t2))
-      else
-        Delay.delay ()
+          bar_update dk kload di iload;
+          for _i = 1 to ticks do FullV.inc () done;
+          FullV.update ()
   in
-    FullV.func (Some (Unix.gettimeofday () |> loop));
+    FullV.func (Some loop);
     FullV.run ()
 ;;
 
@@ -0,0 +1,206 @@
+/* Samples published in POSIX shared memory, so that one collector can
+   serve any number of local readers. The segment holds a header and a
+   ring of `slots' samples of `stride' doubles each, laid out like the
+   slots of apc's sampler ring:
+
+     [total ticks; idle before/after; stat before/after;
+      idle[nidle]; stat[rows * APC_SHM_FIELDS]]
+
+   times are CLOCK_MONOTONIC seconds, `total ticks' counts the sampling
+   periods from the start of the collector up to this sample, so a
+   reader gets the number of ticks between two samples by subtraction.
+
+   There is a single writer. `seq' is twice the number of samples
+   published, plus one while the next one is being written into slot
+   seq / 2 % slots. Readers never write to the segment: they copy a
+   slot and then check that `seq' did not reach it in the meantime,
+   which costs no system call and no work at all on the writer's side */
+#ifndef APCSHM_H
+#define APCSHM_H
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define APC_SHM_MAGIC 0x41504353        /* "APCS" */
+#define APC_SHM_VERSION 1
+#define APC_SHM_SLOTS 64
+#define APC_SHM_FIELDS 7                /* user..softirq per stat row */
+
+struct apc_shm
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nprocs;              /* of the collecting machine */
+  uint32_t nidle;               /* idle times per sample (0 or nprocs) */
+  uint32_t rows;                /* /proc/stat rows per sample */
+  uint32_t stride;              /* doubles per slot */
+  uint32_t slots;
+  uint32_t reserved;
+  double period;                /* seconds */
+  volatile uint64_t seq;
+  double data[];
+};
+
+static inline size_t
+apc_shm_size (unsigned stride)
+{
+  return sizeof (struct apc_shm)
+    + (size_t) APC_SHM_SLOTS * stride * sizeof (double);
+}
+
+/* Create segment `name' (replacing an old one) for writing, NULL
+   (with errno set) on failure */
+static inline struct apc_shm *
+apc_shm_create (const char *name, int nprocs, int nidle, int rows,
+                double period, size_t *lenp)
+{
+  struct apc_shm *shm;
+  unsigned stride = 5 + nidle + rows * APC_SHM_FIELDS;
+  size_t len = apc_shm_size (stride);
+  int fd, err;
+
+  /* a previous segment is unlinked rather than resized under the
+     feet of readers still mapping it, they just stop seeing updates */
+  if (shm_unlink (name) && errno != ENOENT)
+    return NULL;
+  fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    return NULL;
+
+  if (ftruncate (fd, len))
+    {
+      err = errno;
+      close (fd);
+      errno = err;
+      return NULL;
+    }
+
+  shm = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  err = errno;
+  close (fd);
+  if (shm == MAP_FAILED)
+    {
+      errno = err;
+      return NULL;
+    }
+
+  shm->version = APC_SHM_VERSION;
+  shm->nprocs = nprocs;
+  shm->nidle = nidle;
+  shm->rows = rows;
+  shm->stride = stride;
+  shm->slots = APC_SHM_SLOTS;
+  shm->period = period;
+  shm->seq = 0;
+  __sync_synchronize ();
+  shm->magic = APC_SHM_MAGIC;
+
+  *lenp = len;
+  return shm;
+}
+
+/* Map segment `name' read only, NULL (with errno set) if it does not
+   exist or was not written by a compatible collector */
+static inline struct apc_shm *
+apc_shm_open (const char *name, size_t *lenp)
+{
+  struct apc_shm *shm;
+  struct stat st;
+  size_t len;
+  int fd, err;
+
+  fd = shm_open (name, O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &st))
+    goto fail;
+  len = st.st_size;
+  if (len < sizeof (*shm))
+    {
+      errno = EPROTO;
+      goto fail;
+    }
+
+  shm = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  if (shm == MAP_FAILED)
+    goto fail;
+  close (fd);
+
+  if (shm->magic != APC_SHM_MAGIC || shm->version != APC_SHM_VERSION
+      || shm->slots != APC_SHM_SLOTS || apc_shm_size (shm->stride) > len)
+    {
+      munmap (shm, len);
+      errno = EPROTO;
+      return NULL;
+    }
+
+  *lenp = len;
+  return shm;
+
+ fail:
+  err = errno;
+  close (fd);
+  errno = err;
+  return NULL;
+}
+
+static inline double *
+apc_shm_slot (struct apc_shm *shm, uint64_t n)
+{
+  return shm->data + (n % shm->slots) * shm->stride;
+}
+
+/* Writer: publish the sample in `slot' (as above, slot[0] is ignored)
+   as `total' ticks */
+static inline void
+apc_shm_publish (struct apc_shm *shm, const double *slot, double total)
+{
+  uint64_t seq = shm->seq;
+  double *dst = apc_shm_slot (shm, seq / 2);
+
+  shm->seq = seq + 1;
+  __sync_synchronize ();
+  dst[0] = total;
+  memcpy (dst + 1, slot + 1, (shm->stride - 1) * sizeof (double));
+  __sync_synchronize ();
+  shm->seq = seq + 2;
+}
+
+/* Reader: copy sample n (1 based) into dst (stride doubles), 0 on
+   success, -1 if it is not published yet or already overwritten */
+static inline int
+apc_shm_read (const struct apc_shm *shm, uint64_t n, double *dst)
+{
+  uint64_t seq = shm->seq;
+
+  if (!n || n > seq / 2 || n + shm->slots <= (seq + 1) / 2)
+    return -1;
+  __sync_synchronize ();
+  memcpy (dst, apc_shm_slot ((struct apc_shm *) shm, n - 1),
+          shm->stride * sizeof (double));
+  __sync_synchronize ();
+
+  /* slot of sample n is reused once the writer starts on n + slots */
+  return (shm->seq + 1) / 2 < n + shm->slots ? 0 : -1;
+}
+
+/* Reader: copy the latest sample into dst, returns its number, 0 if
+   nothing was published yet */
+static inline uint64_t
+apc_shm_latest (const struct apc_shm *shm, double *dst)
+{
+  uint64_t n;
+
+  do
+    n = shm->seq / 2;
+  while (n && apc_shm_read (shm, n, dst));
+  return n;
+}
+
+#endif
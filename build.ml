@@ -23,23 +23,24 @@ let _ =
     [Filename.concat srcdir "ml_apc.c"]
     StrSet.empty
   ;
-  let prog base =
+  let prog ?(libs="") base =
     gcc "gcc" true
       "-Wall -Werror -g -c" ""
       (base ^ ".o")
       [Filename.concat srcdir (base ^ ".c")]
     ;
     gcc "gcc" false
-      "" ""
+      "" libs
       base
       [base ^ ".o"]
     ;
   in
   prog "hog";
-  prog "idlestat";
+  prog ~libs:"-lrt" "idlestat";
+  prog ~libs:"-lrt" "wakelat";
   ocaml
     "ocamlc.opt"
-    "-custom -thread -g -I +lablGL lablgl.cma lablglut.cma unix.cma threads.cma"
+    "-custom -thread -g -I +lablGL -cclib -lrt lablgl.cma lablglut.cma unix.cma bigarray.cma threads.cma"
     "apc"
     (StrSet.singleton "apc")
     ["ml_apc.o"; "apc.cmo"]
@@ -0,0 +1,128 @@
+/* Idle time from the residency counters of the cpuidle framework
+   (/sys/devices/system/cpu/cpuN/cpuidle/stateK/time, microseconds),
+   for kernels the module can not hook into. All files are opened once
+   and re-read with pread, so a sample costs one syscall per state */
+#ifndef CPUIDLE_H
+#define CPUIDLE_H
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct cpuidle
+{
+  int nprocs;
+  int *first;                   /* fds[first[i]..first[i+1]) belong to CPU i */
+  int *fds;
+};
+
+static inline void
+cpuidle_close (struct cpuidle *c)
+{
+  int i;
+
+  if (c->fds)
+    {
+      for (i = 0; i < c->first[c->nprocs]; ++i)
+        close (c->fds[i]);
+    }
+  free (c->fds);
+  free (c->first);
+  c->fds = NULL;
+  c->first = NULL;
+  c->nprocs = 0;
+}
+
+/* 0 on success, -1 (with errno set) if some CPU has no idle states */
+static inline int
+cpuidle_open (struct cpuidle *c, int nprocs)
+{
+  char path[128];
+  int i, k, fd, n = 0, size = nprocs * 4, *fds;
+
+  c->nprocs = nprocs;
+  c->first = malloc ((nprocs + 1) * sizeof (c->first[0]));
+  c->fds = malloc (size * sizeof (c->fds[0]));
+  if (!c->first || !c->fds)
+    {
+      free (c->first);
+      free (c->fds);
+      c->first = NULL;
+      c->fds = NULL;
+      errno = ENOMEM;
+      return -1;
+    }
+
+  for (i = 0; i < nprocs; ++i)
+    {
+      c->first[i] = n;
+      for (k = 0; ; ++k)
+        {
+          snprintf (path, sizeof (path),
+                    "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/time",
+                    i, k);
+          fd = open (path, O_RDONLY);
+          if (fd < 0)
+            break;
+
+          if (n == size)
+            {
+              fds = realloc (c->fds, 2 * size * sizeof (c->fds[0]));
+              if (!fds)
+                {
+                  close (fd);
+                  errno = ENOMEM;
+                  goto fail;
+                }
+              c->fds = fds;
+              size *= 2;
+            }
+          c->fds[n++] = fd;
+        }
+
+      if (k == 0)
+        {
+          errno = ENOENT;
+          goto fail;
+        }
+    }
+  c->first[nprocs] = n;
+  return 0;
+
+ fail:
+  c->first[c->nprocs = i] = n;
+  cpuidle_close (c);
+  return -1;
+}
+
+/* Total idle microseconds of every CPU into us[0..nprocs), 0 on
+   success, -1 (with errno set) on error */
+static inline int
+cpuidle_read (struct cpuidle *c, uint64_t *us)
+{
+  char buf[32];
+  ssize_t m, j;
+  uint64_t v;
+  int i, k;
+
+  for (i = 0; i < c->nprocs; ++i)
+    {
+      us[i] = 0;
+      for (k = c->first[i]; k < c->first[i + 1]; ++k)
+        {
+          m = pread (c->fds[k], buf, sizeof (buf), 0);
+          if (m < 0)
+            return -1;
+
+          for (v = 0, j = 0; j < m && buf[j] >= '0' && buf[j] <= '9'; ++j)
+            v = v * 10 + (buf[j] - '0');
+          us[i] += v;
+        }
+    }
+  return 0;
+}
+
+#endif
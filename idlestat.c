@@ -1,54 +1,314 @@
 #define _GNU_SOURCE
 #include <err.h>
+#include <errno.h>
 #include <time.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <alloca.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/ioctl.h>
 #include <sys/sysinfo.h>
 
-static double now (void)
+#include "mod/itc.h"
+#include "cpuidle.h"
+#include "ticker.h"
+#include "apcshm.h"
+
+static struct itc_page *page;
+static int *cpumap;             /* column -> CPU number */
+static struct cpuidle cpuidle;  /* used instead of the module if open */
+static struct apc_shm *shm;     /* samples of an apc -publish */
+static double *shmslot;
+static struct itc_header *snap; /* read buffer, grows to nr_cpus records */
+static size_t snapsize;
+
+static void snapgrow (size_t n)
+{
+    if (snapsize < n) {
+        snap = realloc (snap, n);
+        if (!snap) errx (1, "realloc %zu failed", n);
+        snapsize = n;
+    }
+}
+
+static uint64_t idlenow (int fd, int nprocs, uint64_t *p)
+{
+    struct itc_record *rec;
+    size_t n = sizeof (*snap) + nprocs * sizeof (*rec);
+    ssize_t m, k;
+    int i, j;
+
+    if (page) {
+        uint64_t now = itc_clock ();
+
+        for (i = 0; i < nprocs; ++i)
+            p[i] = itc_page_idle (page, cpumap[i], now);
+        return now;
+    }
+
+    if (shm) {
+        if (!apc_shm_latest (shm, shmslot))
+            errx (1, "nothing published yet");
+        for (i = 0; i < nprocs; ++i)
+            p[i] = shmslot[5 + cpumap[i]] * 1e9;
+        return (shmslot[1] + shmslot[2]) * 0.5e9;
+    }
+
+    if (cpuidle.nprocs) {
+        uint64_t now = itc_clock ();
+        uint64_t *us = alloca (cpuidle.nprocs * sizeof (*us));
+
+        if (cpuidle_read (&cpuidle, us)) err (1, "cpuidle read");
+        for (i = 0; i < nprocs; ++i)
+            p[i] = us[cpumap[i]] * 1000;
+        return now;
+    }
+
+    snapgrow (n);
+
+    /* an armed ring (-k) only hands out whole samples, those cover every
+       selected present CPU and may not fit nprocs records. Doubling
+       stays below two samples, so a read never takes more than one */
+    for (;;) {
+        m = read (fd, snap, snapsize);
+        if (m >= 0 || errno != EINVAL || snapsize > (1 << 20))
+            break;
+        snapgrow (2 * snapsize);
+    }
+    if (m < (ssize_t) sizeof (*snap))
+        err (1, "read [n=%zu, m=%zi]", snapsize, m);
+
+    if (snap->version != ITC_VERSION)
+        errx (1, "unsupported itc version %u (expected %u)",
+              snap->version, ITC_VERSION);
+
+    /* the module reports present CPUs, there can be more of them than
+       online ones; the rest of the snapshot comes in further reads
+       (same timestamp) until it is complete */
+    n = sizeof (*snap) + snap->nr_cpus * sizeof (*rec);
+    snapgrow (n);
+    while ((size_t) m < n) {
+        k = read (fd, (char *) snap + m, n - m);
+        if (k <= 0) err (1, "read [n=%zu, m=%zi]", n - m, k);
+        m += k;
+    }
+
+    rec = (struct itc_record *) (snap + 1);
+    for (i = 0, j = 0; i < nprocs; ++i, ++j) {
+        while (j < (int) snap->nr_cpus && rec[j].cpu != (unsigned) cpumap[i])
+            ++j;
+        if (j == (int) snap->nr_cpus)
+            errx (1, "no idle time for cpu %d in the snapshot", cpumap[i]);
+        p[i] = rec[j].idle;
+    }
+    return snap->timestamp;
+}
+
+static void histnow (int fd, int nprocs, struct itc_hist *h)
+{
+    int i;
+
+    for (i = 0; i < nprocs; ++i) {
+        if (page) {
+            itc_page_hist (page, cpumap[i], &h[i]);
+        }
+        else {
+            h[i].cpu = cpumap[i];
+            if (ioctl (fd, ITC_IOC_HIST, &h[i]))
+                err (1, "ioctl ITC_IOC_HIST [cpu=%d]", cpumap[i]);
+        }
+    }
+}
+
+/* Lower bound of the bucket, 2^(k+9) nanoseconds for k > 0 */
+static const char *histlabel (int k)
 {
-    struct timeval tv;
+    static char buf[16];
+    int e = k + 9;
 
-    if (gettimeofday (&tv, NULL))
-        err (1, "gettimeofday");
-    return tv.tv_sec + tv.tv_usec * 1e-6;
+    if (k == 0)
+        return "<1u";
+    if (e >= 30)
+        snprintf (buf, sizeof (buf), "%ds", 1 << (e - 30));
+    else if (e >= 20)
+        snprintf (buf, sizeof (buf), "%dm", 1 << (e - 20));
+    else
+        snprintf (buf, sizeof (buf), "%du", 1 << (e - 10));
+    return buf;
 }
 
-static void idlenow (int fd, int nprocs, double *p)
+static void histprint (int nprocs, struct itc_hist *curr,
+                       struct itc_hist *prev)
 {
-    struct timeval tv;
-    size_t n = nprocs * sizeof (tv);
+    int i, k;
+
+    for (i = 0; i < nprocs; ++i) {
+        printf ("%3d %7llu", cpumap[i],
+                (unsigned long long) (curr[i].entries - prev[i].entries));
+        for (k = 0; k < ITC_HIST_BUCKETS; ++k)
+            printf (" %5llu",
+                    (unsigned long long) (curr[i].count[k]
+                                          - prev[i].count[k]));
+        fputc ('\n', stdout);
+    }
+    fputc ('\n', stdout);
+}
+
+/* Stream idle periods (struct itc_event records as they come from the
+   module) into path ("-" is stdout) until killed */
+static void trace (int fd, const char *path)
+{
+    struct itc_trace tr;
+    struct itc_event ev[4096];
+    FILE *f;
     ssize_t m;
-    struct timeval *buf;
+    size_t i, n;
+
+    f = strcmp (path, "-") ? fopen (path, "wb") : stdout;
+    if (!f) err (1, "fopen %s", path);
+
+    tr.events = 16384;
+    tr.reserved = 0;
+    tr.overruns = 0;
+    if (ioctl (fd, ITC_IOC_TRACE, &tr))
+        err (1, "ioctl ITC_IOC_TRACE [events=%u]", tr.events);
+
+    for (;;) {
+        m = read (fd, ev, sizeof (ev));
+        if (m < 0) err (1, "read trace");
+        n = m / sizeof (ev[0]);
+
+        for (i = 0; i < n; ++i) {
+            if (ev[i].lost)
+                fprintf (stderr, "cpu%u lost %u events\n",
+                         ev[i].cpu, ev[i].lost);
+        }
+
+        if (fwrite (ev, sizeof (ev[0]), n, f) != n)
+            err (1, "fwrite %s", path);
+        if (fflush (f)) err (1, "fflush %s", path);
+    }
+}
+
+/* Cycles the module's idle hook spent so far (module parameter
+   `overhead' must be set for them to be collected) */
+static void overhead (int fd, int nprocs)
+{
+    struct itc_overhead o;
     int i;
 
-    buf = alloca (n);
-    if (!buf) errx (1, "alloca failed");
+    printf ("cpu    enter: min     avg     max    exit: min     avg     max\n");
+    for (i = 0; i < nprocs; ++i) {
+        o.cpu = cpumap[i];
+        if (ioctl (fd, ITC_IOC_OVERHEAD, &o))
+            err (1, "ioctl ITC_IOC_OVERHEAD [cpu=%d]", cpumap[i]);
+        if (!o.enter.count || !o.exit.count)
+            continue;
 
-    m = read (fd, buf, n);
-    if (n - m) err (1, "read [n=%zu, m=%zi]", n, m);
+        printf ("%3d %15llu %7llu %7llu %15llu %7llu %7llu\n", cpumap[i],
+                (unsigned long long) o.enter.min,
+                (unsigned long long) (o.enter.sum / o.enter.count),
+                (unsigned long long) o.enter.max,
+                (unsigned long long) o.exit.min,
+                (unsigned long long) (o.exit.sum / o.exit.count),
+                (unsigned long long) o.exit.max);
+    }
+    exit (0);
+}
 
-    for (i = 0; i < nprocs; ++i)
-        p[i] = buf[i].tv_sec + buf[i].tv_usec * 1e-6;
+/* Only watch the CPUs we are allowed to run on (cpuset/taskset), the
+   module then reports just those */
+static int affinity (int fd, int nprocs)
+{
+    cpu_set_t set;
+    uint64_t mask[CPU_SETSIZE / 64];
+    struct itc_cpus c;
+    int i, n = 0;
+
+    if (sched_getaffinity (0, sizeof (set), &set))
+        err (1, "sched_getaffinity");
+
+    memset (mask, 0, sizeof (mask));
+    for (i = 0; i < nprocs && i < CPU_SETSIZE; ++i) {
+        if (CPU_ISSET (i, &set)) {
+            mask[i / 64] |= 1ull << (i % 64);
+            cpumap[n++] = i;
+        }
+    }
+
+    if (!page && !cpuidle.nprocs && !shm) {
+        c.nr_cpus = nprocs;
+        c.reserved = 0;
+        c.mask = (uintptr_t) mask;
+        if (ioctl (fd, ITC_IOC_CPUS, &c))
+            err (1, "ioctl ITC_IOC_CPUS");
+    }
+    return n;
+}
+
+/* Let the module take the samples at exact instants, reads then block
+   until the next one is queued */
+static void arm (int fd, uint64_t period)
+{
+    struct itc_sampling smp;
+
+    smp.period = period;
+    smp.samples = 16;
+    smp.overruns = 0;
+    if (ioctl (fd, ITC_IOC_SAMPLE, &smp))
+        err (1, "ioctl ITC_IOC_SAMPLE [period=%llu]",
+             (unsigned long long) smp.period);
 }
 
 int main (int argc, char **argv)
 {
-    int fd;
-    int n = 1;
+    int fd, i;
+    double n = 1.0;
+    uint64_t period;
+    struct ticker ticker = { -1, 0, 0 };
     int nprocs;
-    double *idle;
-    double *curr, *prev;
-
-    (void) argc;
-    (void) argv;
+    int timed = 0;
+    int hist = 0;
+    int pinned = 0;
+    int cost = 0;
+    int sysfs = 0;
+    const char *tracefile = NULL;
+    const char *shmname = NULL;
+    size_t len;
+    uint64_t *idle;
+    uint64_t *curr, *prev;
+    uint64_t s, e;
+    struct itc_hist *hcurr = NULL, *hprev = NULL;
 
-    if (argc > 1)
-        n = atoi (argv[1]);
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp (argv[i], "-k"))
+            timed = 1;
+        else if (!strcmp (argv[i], "-h"))
+            hist = 1;
+        else if (!strcmp (argv[i], "-c"))
+            pinned = 1;
+        else if (!strcmp (argv[i], "-o"))
+            cost = 1;
+        else if (!strcmp (argv[i], "-s"))
+            sysfs = 1;
+        else if (!strcmp (argv[i], "-trace")) {
+            if (++i == argc) errx (1, "-trace requires a file name");
+            tracefile = argv[i];
+        }
+        else if (!strcmp (argv[i], "-shm")) {
+            if (++i == argc) errx (1, "-shm requires a segment name");
+            shmname = argv[i];
+        }
+        else
+            n = atof (argv[i]);
+    }
+    if (!(n > 0.0)) errx (1, "interval must be positive");
+    period = n * 1e9;
+    if (!period) errx (1, "interval %g is too small", n);
 
     nprocs = get_nprocs ();
     if (nprocs <= 0) errx (1, "get_nprocs returned %d", nprocs);
@@ -56,26 +316,101 @@ int main (int argc, char **argv)
     idle = malloc (2 * nprocs * sizeof (idle[0]));
     if (!idle) errx (1, "malloc %zu failed", 2 * nprocs * sizeof (idle[0]));
 
-    fd = open ("/dev/itc", O_RDONLY);
-    if (fd < 0) err (1, "open /dev/itc");
+    cpumap = malloc (nprocs * sizeof (cpumap[0]));
+    if (!cpumap) errx (1, "malloc %zu failed", nprocs * sizeof (cpumap[0]));
+    for (i = 0; i < nprocs; ++i)
+        cpumap[i] = i;
+
+    if (shmname) {
+        /* somebody else samples, all we do is read their memory */
+        shm = apc_shm_open (shmname, &len);
+        if (!shm) err (1, "shm_open %s", shmname);
+        if (shm->nidle < (unsigned) nprocs)
+            errx (1, "%s publishes %u idle times, expected %d",
+                  shmname, shm->nidle, nprocs);
+        shmslot = malloc (shm->stride * sizeof (*shmslot));
+        if (!shmslot) errx (1, "malloc %zu failed",
+                            shm->stride * sizeof (*shmslot));
+        if (timed || hist || cost || tracefile)
+            errx (1, "-k, -h, -o and -trace require the itc module");
+        fd = -1;
+    }
+    else
+        fd = sysfs ? -1 : open ("/dev/itc", O_RDONLY);
+    if (fd < 0 && !shm) {
+        /* kernels without anything to hook still have cpuidle */
+        if (!sysfs && errno != ENOENT && errno != ENODEV && errno != ENXIO)
+            err (1, "open /dev/itc");
+        if (cpuidle_open (&cpuidle, nprocs))
+            err (1, sysfs ? "cpuidle" : "open /dev/itc (and cpuidle)");
+        if (timed || hist || cost || tracefile)
+            errx (1, "-k, -h, -o and -trace require the itc module");
+    }
+
+    if (tracefile) trace (fd, tracefile);
+
+    if (!timed && fd >= 0) {
+        page = itc_mmap (fd, &len);
+        if (page && page->nr_cpus < (unsigned) nprocs)
+            errx (1, "itc exports %u CPUs, expected %d",
+                  page->nr_cpus, nprocs);
+    }
+
+    if (pinned)
+        nprocs = affinity (fd, nprocs);
 
-    idlenow (fd, nprocs, idle);
+    if (cost)
+        overhead (fd, nprocs);
+
+    if (timed)
+        arm (fd, period);
+    else
+        ticker_start (&ticker, period);
 
     curr = &idle[nprocs];
     prev = idle;
     setbuf (stdout, NULL);
 
+    if (hist) {
+        hprev = malloc (2 * nprocs * sizeof (*hprev));
+        if (!hprev) errx (1, "malloc %zu failed",
+                          2 * nprocs * sizeof (*hprev));
+        hcurr = &hprev[nprocs];
+
+        printf ("cpu entries");
+        for (i = 0; i < ITC_HIST_BUCKETS; ++i)
+            printf (" %5s", histlabel (i));
+        printf ("\n\n");
+        histnow (fd, nprocs, hprev);
+    }
+
+    s = idlenow (fd, nprocs, prev);
     for (;;) {
-        int i;
-        double s, e, d, *t, a = 0.0, ai = 0.0;
-
-        idlenow (fd, nprocs, prev);
-        s = now ();
-        sleep (n);
-        idlenow (fd, nprocs, curr);
-        e = now ();
+        uint64_t *t;
+        double d, a = 0.0, ai = 0.0;
+
+        if (!timed) {
+            int ticks = ticker_wait (&ticker, 0);
+
+            if (ticks < 0) err (1, "ticker_wait");
+            if (ticks == 0) continue;
+            if (ticks > 1) fprintf (stderr, "missed %d ticks\n", ticks - 1);
+        }
+        e = idlenow (fd, nprocs, curr);
         d = e - s;
 
+        if (hist) {
+            struct itc_hist *ht;
+
+            histnow (fd, nprocs, hcurr);
+            histprint (nprocs, hcurr, hprev);
+            ht = hcurr;
+            hcurr = hprev;
+            hprev = ht;
+            s = e;
+            continue;
+        }
+
         for (i = 0; i < nprocs; ++i) {
             double di = curr[i] - prev[i];
 
@@ -96,5 +431,6 @@ int main (int argc, char **argv)
         t = curr;
         curr = prev;
         prev = t;
+        s = e;
     }
 }
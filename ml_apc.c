@@ -1,3 +1,7 @@
+/* must precede every system header */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <caml/fail.h>
 #include <caml/alloc.h>
 #include <caml/memory.h>
@@ -35,7 +39,6 @@ static void failwith_fmt (const char *fmt, ...)
 }
 
 #if defined __linux__
-#define _GNU_SOURCE
 #include <alloca.h>
 #include <unistd.h>
 #include <sys/time.h>
@@ -43,8 +46,19 @@ static void failwith_fmt (const char *fmt, ...)
 #include <sys/sysinfo.h>
 #include <signal.h>
 #include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
 #include <errno.h>
 
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "mod/itc.h"
+#include "cpuidle.h"
+#include "ticker.h"
+#include "apcshm.h"
+
 CAMLprim value ml_sysinfo (value unit_v)
 {
     CAMLparam1 (unit_v);
@@ -74,6 +88,50 @@ CAMLprim value ml_sysinfo (value unit_v)
     CAMLreturn (res_v);
 }
 
+/* CPU number of every online CPU (module records and mapped counters
+   are indexed by CPU number, apc columns count online CPUs only) */
+static int *online;
+
+static void online_map (int nprocs)
+{
+    FILE *f;
+    int i, n = 0, lo, hi;
+
+    free (online);
+    online = malloc (nprocs * sizeof (*online));
+    if (!online) {
+        failwith_fmt ("malloc %zu failed", nprocs * sizeof (*online));
+    }
+
+    /* "0-3,6,8-9" */
+    f = fopen ("/sys/devices/system/cpu/online", "r");
+    if (f) {
+        while (n >= 0 && fscanf (f, "%d", &lo) == 1) {
+            hi = lo;
+            if (fscanf (f, "-%d", &hi) != 1) {
+                hi = lo;
+            }
+            for (i = lo; i <= hi; ++i) {
+                if (n == nprocs) {
+                    n = -1;
+                    break;
+                }
+                online[n++] = i;
+            }
+            if (fgetc (f) != ',') {
+                break;
+            }
+        }
+        fclose (f);
+    }
+
+    if (n != nprocs) {
+        for (i = 0; i < nprocs; ++i) {
+            online[i] = i;
+        }
+    }
+}
+
 CAMLprim value ml_get_nprocs (value unit_v)
 {
     CAMLparam1 (unit_v);
@@ -83,42 +141,691 @@ CAMLprim value ml_get_nprocs (value unit_v)
     if (nprocs <= 0) {
         failwith_fmt ("get_nprocs: %s", strerror (errno));
     }
+    online_map (nprocs);
 
     CAMLreturn (Val_int (nprocs));
 }
 
+static struct {
+    int fd;
+    int tried;
+    size_t len;
+    struct itc_page *page;
+} itc_map;
+
+/* Counters mapped from the module (if it can do that), so that sampling
+   does not have to enter the kernel at all */
+static struct itc_page *itc_getpage (int fd, int nprocs)
+{
+    if (!itc_map.tried || itc_map.fd != fd) {
+        if (itc_map.page) {
+            munmap (itc_map.page, itc_map.len);
+        }
+        itc_map.fd = fd;
+        itc_map.tried = 1;
+        itc_map.page = itc_mmap (fd, &itc_map.len);
+        if (itc_map.page
+            && itc_map.page->nr_cpus <= (unsigned) online[nprocs - 1]) {
+            munmap (itc_map.page, itc_map.len);
+            itc_map.page = NULL;
+        }
+    }
+    return itc_map.page;
+}
+
+/* The *_fill helpers below also run on the sampler thread, outside of
+   the OCaml runtime, so instead of raising they return what failed
+   (NULL on success) with errno set. If ts is not NULL CLOCK_MONOTONIC
+   seconds right before and after the read go to ts[0] and ts[1] */
+
+/* Records of the largest snapshot seen so far, the first read of the
+   next one is sized for that many */
+static volatile unsigned itc_records;
+
+/* Idle seconds of every online CPU into p[0..nprocs) */
+static const char *idle_fill (int fd, double *p, int nprocs, double *ts)
+{
+    struct itc_header *hdr, *big;
+    struct itc_record *rec;
+    struct itc_page *page;
+    size_t n, need;
+    ssize_t m, k;
+    int i, j;
+
+    page = itc_getpage (fd, nprocs);
+    if (page) {
+        __u64 now = itc_clock ();
+
+        for (i = 0; i < nprocs; ++i) {
+            p[i] = itc_page_idle (page, online[i], now) * 1e-9;
+        }
+        if (ts) {
+            ts[0] = now * 1e-9;
+            ts[1] = itc_clock () * 1e-9;
+        }
+        return NULL;
+    }
+
+    n = sizeof (*hdr)
+        + (itc_records > (unsigned) nprocs ? itc_records : (unsigned) nprocs)
+        * sizeof (*rec);
+    hdr = alloca (n);
+    if (!hdr) {
+        errno = ENOMEM;
+        return "alloca";
+    }
+
+    if (ts) {
+        ts[0] = itc_clock () * 1e-9;
+    }
+    m = read (fd, hdr, n);
+    if (m >= (ssize_t) sizeof (*hdr) && hdr->version == ITC_VERSION) {
+        /* the module reports present CPUs, there can be more of them
+           than online ones; the rest of the snapshot (same timestamp)
+           comes in further reads */
+        need = sizeof (*hdr) + hdr->nr_cpus * sizeof (*rec);
+        if (need > n) {
+            big = alloca (need);
+            if (!big) {
+                errno = ENOMEM;
+                return "alloca";
+            }
+            memcpy (big, hdr, m);
+            hdr = big;
+            itc_records = hdr->nr_cpus;
+        }
+        while ((size_t) m < need) {
+            k = read (fd, (char *) hdr + m, need - m);
+            if (k <= 0) {
+                m = k;
+                break;
+            }
+            m += k;
+        }
+    }
+    if (ts) {
+        ts[1] = itc_clock () * 1e-9;
+    }
+
+    if (m < (ssize_t) sizeof (*hdr)
+        || (hdr->version == ITC_VERSION
+            && (size_t) m != sizeof (*hdr) + hdr->nr_cpus * sizeof (*rec))) {
+        if (m >= 0) {
+            errno = EIO;
+        }
+        return "itc read";
+    }
+
+    if (hdr->version != ITC_VERSION) {
+        errno = EPROTO;
+        return "itc version";
+    }
+
+    rec = (struct itc_record *) (hdr + 1);
+    for (i = 0, j = 0; i < nprocs; ++i, ++j) {
+        while (j < (int) hdr->nr_cpus && rec[j].cpu != (unsigned) online[i]) {
+            ++j;
+        }
+        if (j == (int) hdr->nr_cpus) {
+            errno = ENODEV;
+            return "itc snapshot without an online cpu";
+        }
+        p[i] = rec[j].idle * 1e-9;
+    }
+    return NULL;
+}
+
 CAMLprim value ml_idletimeofday (value fd_v, value nprocs_v)
 {
     CAMLparam2 (fd_v, nprocs_v);
     CAMLlocal1 (res_v);
-    struct timeval tv;
     int fd = Int_val (fd_v);
     int nprocs = Int_val (nprocs_v);
-    size_t n = nprocs * sizeof (tv);
+    const char *what;
+    double *p;
+    int i, errno_code;
+
+    p = alloca (nprocs * sizeof (*p));
+
+    caml_enter_blocking_section ();
+    {
+        what = idle_fill (fd, p, nprocs, NULL);
+        errno_code = errno;
+    }
+    caml_leave_blocking_section ();
+
+    if (what) {
+        failwith_fmt ("%s: %s", what, strerror (errno_code));
+    }
+
+    res_v = caml_alloc (nprocs * Double_wosize, Double_array_tag);
+    for (i = 0; i < nprocs; ++i) {
+        Store_double_field (res_v, i, p[i]);
+    }
+    CAMLreturn (res_v);
+}
+
+/* /proc/stat stays open and is re-read into the same buffer, the cpu
+   lines are parsed in place so that sampling allocates nothing */
+#define STAT_FIELDS 7
+
+static struct {
+    int fd;
+    char *buf;
+    size_t size;
+    double hz;
+} procstat = { -1, NULL, 0, 0.0 };
+
+static const char *stat_read (const char **bufp)
+{
     ssize_t m;
-    struct timeval *buf;
+    char *buf;
+
+    if (procstat.fd < 0) {
+        long clk_tck = sysconf (_SC_CLK_TCK);
+
+        if (clk_tck <= 0) {
+            return "sysconf (SC_CLK_TCK)";
+        }
+        procstat.hz = clk_tck;
+
+        procstat.fd = open ("/proc/stat", O_RDONLY);
+        if (procstat.fd < 0) {
+            return "open /proc/stat";
+        }
+    }
+
+    for (;;) {
+        if (!procstat.buf) {
+            procstat.size = 8192;
+            procstat.buf = malloc (procstat.size);
+            if (!procstat.buf) {
+                return "malloc";
+            }
+        }
+
+        m = pread (procstat.fd, procstat.buf, procstat.size - 1, 0);
+        if (m < 0) {
+            return "pread /proc/stat";
+        }
+
+        /* a full buffer might mean truncation */
+        if ((size_t) m < procstat.size - 1) {
+            procstat.buf[m] = 0;
+            *bufp = procstat.buf;
+            return NULL;
+        }
+
+        buf = realloc (procstat.buf, procstat.size * 2);
+        if (!buf) {
+            return "realloc";
+        }
+        procstat.buf = buf;
+        procstat.size *= 2;
+    }
+}
+
+/* Fill rows of STAT_FIELDS seconds (user nice system idle iowait irq
+   softirq) from the leading `cpu' lines: aggregate first then every
+   CPU, fields missing on old kernels are zero */
+static const char *stat_fill (double *p, long rows, double *ts)
+{
+    const char *s, *what;
+    unsigned long long v;
+    long r;
     int i;
 
-    buf = alloca (n);
-    if (!buf) {
-        failwith_fmt ("alloca failed");
+    if (ts) {
+        ts[0] = itc_clock () * 1e-9;
+    }
+    what = stat_read (&s);
+    if (ts) {
+        ts[1] = itc_clock () * 1e-9;
+    }
+    if (what) {
+        return what;
+    }
+
+    for (r = 0; r < rows; ++r, p += STAT_FIELDS) {
+        if (s[0] != 'c' || s[1] != 'p' || s[2] != 'u') {
+            errno = EPROTO;
+            return "/proc/stat has fewer cpu lines than CPUs";
+        }
+        for (s += 3; *s >= '0' && *s <= '9'; ++s) {
+        }
+
+        for (i = 0; i < STAT_FIELDS; ++i) {
+            while (*s == ' ') {
+                ++s;
+            }
+            for (v = 0; *s >= '0' && *s <= '9'; ++s) {
+                v = v * 10 + (*s - '0');
+            }
+            p[i] = v / procstat.hz;
+        }
+
+        while (*s && *s++ != '\n') {
+        }
     }
+    return NULL;
+}
 
-    m = read (fd, buf, n);
-    if (n - m) {
-        failwith_fmt ("read [n=%zu, m=%zi]: %s", n, m, strerror (errno));
+CAMLprim value ml_stat_into (value ba_v)
+{
+    CAMLparam1 (ba_v);
+    const char *what;
+
+    what = stat_fill (Caml_ba_data_val (ba_v),
+                      Caml_ba_array_val (ba_v)->dim[0] / STAT_FIELDS, NULL);
+    if (what) {
+        failwith_fmt ("%s: %s", what, strerror (errno));
+    }
+    CAMLreturn (Val_unit);
+}
+
+static struct cpuidle cpuidle;
+
+CAMLprim value ml_cpuidle_open (value nprocs_v)
+{
+    CAMLparam1 (nprocs_v);
+    int nprocs = Int_val (nprocs_v);
+
+    if (cpuidle.nprocs != nprocs) {
+        cpuidle_close (&cpuidle);
+        if (cpuidle_open (&cpuidle, nprocs)) {
+            CAMLreturn (Val_false);
+        }
+    }
+    CAMLreturn (Val_true);
+}
+
+static const char *cpuidle_fill (double *p, int nprocs, double *ts)
+{
+    uint64_t *us;
+    int i, ret;
+
+    if (cpuidle.nprocs != nprocs) {
+        errno = EINVAL;
+        return "cpuidle is not open for all CPUs";
+    }
+
+    us = alloca (nprocs * sizeof (*us));
+    if (ts) {
+        ts[0] = itc_clock () * 1e-9;
+    }
+    ret = cpuidle_read (&cpuidle, us);
+    if (ts) {
+        ts[1] = itc_clock () * 1e-9;
+    }
+    if (ret) {
+        return "cpuidle read";
     }
 
-    res_v = caml_alloc (nprocs * Double_wosize, Double_array_tag);
     for (i = 0; i < nprocs; ++i) {
-        double d;
+        p[i] = us[i] * 1e-6;
+    }
+    return NULL;
+}
+
+/* One sample of every source: idle times from fd (/dev/itc, or
+   cpuidle if negative) into ibuf[0..nprocs), rows of /proc/stat into
+   kbuf, either skipped when empty. ts, unless NULL, gets the
+   timestamps of both reads (idle before/after, stat before/after) so
+   that every source is differenced against its own time base */
+static const char *snapshot_fill (int fd, double *ibuf, int nprocs,
+                                  double *kbuf, long rows, double *ts)
+{
+    const char *what = NULL;
+
+    if (nprocs) {
+        what = fd >= 0
+            ? idle_fill (fd, ibuf, nprocs, ts)
+            : cpuidle_fill (ibuf, nprocs, ts);
+    }
+    if (!what && rows) {
+        what = stat_fill (kbuf, rows, ts ? ts + 2 : NULL);
+    }
+    return what;
+}
+
+/* fd for snapshot_fill from an Apc.NP.idlesrc (Itc fd | Cpuidle) */
+#define Idlesrc_val(v) (Is_block (v) ? Int_val (Field (v, 0)) : -1)
+
+CAMLprim value ml_snapshot (value src_v, value ibuf_v, value kbuf_v,
+                            value ts_v)
+{
+    CAMLparam4 (src_v, ibuf_v, kbuf_v, ts_v);
+    int fd = Idlesrc_val (src_v);
+    double *ibuf = Caml_ba_data_val (ibuf_v);
+    double *kbuf = Caml_ba_data_val (kbuf_v);
+    double *ts = Caml_ba_data_val (ts_v);
+    int nprocs = Caml_ba_array_val (ibuf_v)->dim[0];
+    long rows = Caml_ba_array_val (kbuf_v)->dim[0] / STAT_FIELDS;
+    const char *what;
+    int errno_code;
+
+    if (Caml_ba_array_val (ts_v)->dim[0] < 4) {
+        failwith_fmt ("snapshot: timestamp array too small");
+    }
+
+    caml_enter_blocking_section ();
+    {
+        what = snapshot_fill (fd, ibuf, nprocs, kbuf, rows, ts);
+        errno_code = errno;
+    }
+    caml_leave_blocking_section ();
+
+    if (what) {
+        failwith_fmt ("%s: %s", what, strerror (errno_code));
+    }
+    CAMLreturn (Val_unit);
+}
+
+/* Sampler thread: takes a snapshot on every tick, independently of
+   whatever the renderer is doing, and publishes it into a single
+   producer/single consumer ring. A slot holds the number of ticks it
+   accounts for, the four timestamps, idle times and stat rows. A full
+   ring drops the snapshot and its ticks go to the next one published,
+   so the consumer still sees every tick. With a shared memory segment
+   (see ml_shm_publish) every snapshot is published there as well, if
+   the ring is full it is taken into the spare slot past its end */
+#define SAMPLER_SLOTS 64
+
+static struct apc_shm *published;
+
+static struct {
+    pthread_t thread;
+    int running;
+    int fd;
+    int nprocs;
+    long rows;
+    size_t stride;
+    double *slots;
+    struct ticker ticker;
+    int pipe[2];                /* wakes up the consumer */
+    volatile unsigned head;     /* written by the producer only */
+    volatile unsigned tail;     /* written by the consumer only */
+    const char *volatile what;  /* set when the thread died */
+    int errno_code;
+} sampler = { .running = 0, .pipe = { -1, -1 } };
+
+static void *sampler_thread (void *unused)
+{
+    unsigned head = sampler.head;
+    double pending = 0.0, total = 0.0;
+    const char *what;
+    double *slot;
+    int ticks, full;
+    char c = 0;
+
+    (void) unused;
+    for (;;) {
+        ticks = ticker_wait (&sampler.ticker, 0);
+        if (ticks < 0) {
+            what = "ticker_wait";
+            break;
+        }
+        pending += ticks;
+        total += ticks;
+        full = head - sampler.tail == SAMPLER_SLOTS;
+        if (!ticks || (full && !published)) {
+            continue;
+        }
+        __sync_synchronize ();
+
+        slot = sampler.slots
+            + (full ? SAMPLER_SLOTS : head % SAMPLER_SLOTS) * sampler.stride;
+        what = snapshot_fill (sampler.fd, slot + 5, sampler.nprocs,
+                              slot + 5 + sampler.nprocs, sampler.rows,
+                              slot + 1);
+        if (what) {
+            break;
+        }
+        if (published) {
+            apc_shm_publish (published, slot, total);
+        }
+        if (full) {
+            continue;
+        }
+        slot[0] = pending;
+        pending = 0.0;
+
+        __sync_synchronize ();
+        sampler.head = ++head;
+        if (write (sampler.pipe[1], &c, 1) < 0 && errno != EAGAIN) {
+            what = "sampler pipe";
+            break;
+        }
+    }
+    sampler.errno_code = errno;
+    __sync_synchronize ();
+    sampler.what = what;
+    if (write (sampler.pipe[1], &c, 1) < 0) {
+        /* the consumer notices `what' at its next timeout anyway */
+    }
+    return NULL;
+}
+
+/* Start sampling from src (see ml_snapshot) every period seconds, nprocs
+   idle times and rows stat rows per sample, pinned to cpu unless it is
+   negative */
+CAMLprim value ml_sampler_start (value src_v, value nprocs_v, value rows_v,
+                                 value period_v, value cpu_v)
+{
+    CAMLparam5 (src_v, nprocs_v, rows_v, period_v, cpu_v);
+    uint64_t period = Double_val (period_v) * 1e9;
+    int cpu = Int_val (cpu_v);
+    int ret, i;
+
+    if (sampler.running) {
+        failwith ("sampler is already running");
+    }
+    if (!period) {
+        failwith_fmt ("sampler period %g is too small", Double_val (period_v));
+    }
+
+    sampler.fd = Idlesrc_val (src_v);
+    sampler.nprocs = Int_val (nprocs_v);
+    sampler.rows = Int_val (rows_v);
+    sampler.stride = 5 + sampler.nprocs + sampler.rows * STAT_FIELDS;
+    if (published && published->stride != sampler.stride) {
+        failwith ("sampler: published segment has a different layout");
+    }
+    /* plus the spare slot */
+    sampler.slots = malloc ((SAMPLER_SLOTS + 1) * sampler.stride
+                            * sizeof (double));
+    if (!sampler.slots) {
+        failwith_fmt ("malloc %zu failed",
+                      (SAMPLER_SLOTS + 1) * sampler.stride * sizeof (double));
+    }
+
+    if (pipe (sampler.pipe)) {
+        free (sampler.slots);
+        failwith_fmt ("pipe: %s", strerror (errno));
+    }
+    for (i = 0; i < 2; ++i) {
+        fcntl (sampler.pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl (sampler.pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    sampler.head = sampler.tail = 0;
+    sampler.what = NULL;
+    ticker_start (&sampler.ticker, period);
+
+    ret = pthread_create (&sampler.thread, NULL, sampler_thread, NULL);
+    if (ret) {
+        ticker_stop (&sampler.ticker);
+        close (sampler.pipe[0]);
+        close (sampler.pipe[1]);
+        free (sampler.slots);
+        failwith_fmt ("pthread_create: %s", strerror (ret));
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO (&set);
+        CPU_SET (cpu, &set);
+        ret = pthread_setaffinity_np (sampler.thread, sizeof (set), &set);
+        if (ret) {
+            fprintf (stderr, "could not pin the sampler to cpu %d: %s\n",
+                     cpu, strerror (ret));
+        }
+    }
+    sampler.running = 1;
+    CAMLreturn (Val_unit);
+}
+
+/* Copy the oldest published sample into ibuf, kbuf and ts (as for
+   ml_snapshot) waiting up to timeout_v seconds for one. Returns the
+   number of ticks the sample accounts for, 0 if there was none */
+CAMLprim value ml_sampler_next (value timeout_v, value ibuf_v, value kbuf_v,
+                                value ts_v)
+{
+    CAMLparam4 (timeout_v, ibuf_v, kbuf_v, ts_v);
+    int timeout = Double_val (timeout_v) * 1e3;
+    double *ibuf = Caml_ba_data_val (ibuf_v);
+    double *kbuf = Caml_ba_data_val (kbuf_v);
+    double *ts = Caml_ba_data_val (ts_v);
+    unsigned tail = sampler.tail;
+    const double *slot;
+    struct pollfd pfd;
+    char buf[SAMPLER_SLOTS];
+    int ticks;
+
+    if (!sampler.running) {
+        failwith ("sampler is not running");
+    }
+    if (Caml_ba_array_val (ibuf_v)->dim[0] != sampler.nprocs
+        || Caml_ba_array_val (kbuf_v)->dim[0] / STAT_FIELDS != sampler.rows
+        || Caml_ba_array_val (ts_v)->dim[0] < 4) {
+        failwith ("sampler_next: buffer sizes do not match");
+    }
+
+    if (sampler.head == tail && !sampler.what) {
+        pfd.fd = sampler.pipe[0];
+        pfd.events = POLLIN;
+        caml_enter_blocking_section ();
+        {
+            poll (&pfd, 1, timeout);
+        }
+        caml_leave_blocking_section ();
+    }
+    while (read (sampler.pipe[0], buf, sizeof (buf)) > 0) {
+    }
+
+    if (sampler.head == tail) {
+        if (sampler.what) {
+            failwith_fmt ("sampler: %s: %s", sampler.what,
+                          strerror (sampler.errno_code));
+        }
+        CAMLreturn (Val_int (0));
+    }
+
+    __sync_synchronize ();
+    slot = sampler.slots + (tail % SAMPLER_SLOTS) * sampler.stride;
+    ticks = slot[0];
+    memcpy (ts, slot + 1, 4 * sizeof (double));
+    memcpy (ibuf, slot + 5, sampler.nprocs * sizeof (double));
+    memcpy (kbuf, slot + 5 + sampler.nprocs,
+            sampler.rows * STAT_FIELDS * sizeof (double));
+    __sync_synchronize ();
+    sampler.tail = tail + 1;
+    CAMLreturn (Val_int (ticks));
+}
+
+/* Make the sampler thread (started afterwards with the same nprocs,
+   rows and period) publish every sample in POSIX shared memory segment
+   name_v as well, see apcshm.h */
+CAMLprim value ml_shm_publish (value name_v, value nprocs_v, value rows_v,
+                               value period_v)
+{
+    CAMLparam4 (name_v, nprocs_v, rows_v, period_v);
+    size_t len;
+
+    if (published) {
+        failwith ("shm_publish: already publishing");
+    }
+    published = apc_shm_create (String_val (name_v), get_nprocs (),
+                                Int_val (nprocs_v), Int_val (rows_v),
+                                Double_val (period_v), &len);
+    if (!published) {
+        failwith_fmt ("shm_open %s: %s", String_val (name_v),
+                      strerror (errno));
+    }
+    CAMLreturn (Val_unit);
+}
 
-        d = buf[i].tv_sec + buf[i].tv_usec * 1e-6;
-        Store_double_field (res_v, i, d);
+static struct {
+    struct apc_shm *shm;
+    size_t len;
+    double *slot;
+} attached;
+
+/* Map segment name_v published by another apc, returns the number of
+   idle times and of stat rows per sample and the sampling period */
+CAMLprim value ml_shm_attach (value name_v)
+{
+    CAMLparam1 (name_v);
+    CAMLlocal1 (res_v);
+    struct apc_shm *shm;
+
+    if (attached.shm) {
+        failwith ("shm_attach: already attached");
+    }
+    shm = apc_shm_open (String_val (name_v), &attached.len);
+    if (!shm) {
+        failwith_fmt ("shm_open %s: %s", String_val (name_v),
+                      errno == EPROTO
+                      ? "not published by this version of apc"
+                      : strerror (errno));
     }
+    if (shm->nprocs != (unsigned) get_nprocs ()) {
+        failwith_fmt ("%s: published for %u CPUs, this machine has %d",
+                      String_val (name_v), shm->nprocs, get_nprocs ());
+    }
+    attached.slot = malloc (shm->stride * sizeof (double));
+    if (!attached.slot) {
+        failwith_fmt ("malloc %zu failed", shm->stride * sizeof (double));
+    }
+    attached.shm = shm;
+
+    res_v = caml_alloc_tuple (3);
+    Store_field (res_v, 0, Val_int (shm->nidle));
+    Store_field (res_v, 1, Val_int (shm->rows));
+    Store_field (res_v, 2, caml_copy_double (shm->period));
     CAMLreturn (res_v);
 }
 
+/* Copy the latest published sample into ibuf, kbuf and ts (as for
+   ml_sampler_next), returns the total number of ticks up to it, 0 if
+   there is none yet. No system call is involved */
+CAMLprim value ml_shm_latest (value ibuf_v, value kbuf_v, value ts_v)
+{
+    CAMLparam3 (ibuf_v, kbuf_v, ts_v);
+    const struct apc_shm *shm = attached.shm;
+    const double *slot = attached.slot;
+
+    if (!shm) {
+        failwith ("shm_latest: not attached");
+    }
+    if (Caml_ba_array_val (ibuf_v)->dim[0] != shm->nidle
+        || Caml_ba_array_val (kbuf_v)->dim[0] / STAT_FIELDS != shm->rows
+        || Caml_ba_array_val (ts_v)->dim[0] < 4) {
+        failwith ("shm_latest: buffer sizes do not match");
+    }
+
+    if (!apc_shm_latest (shm, attached.slot)) {
+        CAMLreturn (caml_copy_double (0.0));
+    }
+    memcpy (Caml_ba_data_val (ts_v), slot + 1, 4 * sizeof (double));
+    memcpy (Caml_ba_data_val (ibuf_v), slot + 5,
+            shm->nidle * sizeof (double));
+    memcpy (Caml_ba_data_val (kbuf_v), slot + 5 + shm->nidle,
+            shm->rows * STAT_FIELDS * sizeof (double));
+    CAMLreturn (caml_copy_double (slot[0]));
+}
+
 CAMLprim value ml_os_type (value unit_v)
 {
     CAMLparam1 (unit_v);
@@ -258,6 +965,27 @@ CAMLprim value ml_waitalrm (value unit_v)
     CAMLreturn (Val_unit);
 }
 
+CAMLprim value ml_ticker_start (value period_v)
+{
+    CAMLparam1 (period_v);
+    failwith ("ticker not supported on Windows");
+    CAMLreturn (Val_unit);
+}
+
+CAMLprim value ml_ticker_wait (value timeout_v)
+{
+    CAMLparam1 (timeout_v);
+    failwith ("ticker not supported on Windows");
+    CAMLreturn (Val_unit);
+}
+
+CAMLprim value ml_write_floats (value fd_v, value ba_v)
+{
+    CAMLparam2 (fd_v, ba_v);
+    failwith ("binary output not supported on Windows");
+    CAMLreturn (Val_unit);
+}
+
 static void pmc (int nproc, double *clocksp, double *unhaltedp)
 {
     unsigned int h1, l1, h2, l2, p;
@@ -368,9 +1096,9 @@ CAMLprim value ml_nice (value nice_v)
     CAMLreturn (Val_unit);
 }
 
-CAMLprim value ml_seticon (value data_v)
+CAMLprim value ml_seticon (value ky_v, value iy_v)
 {
-    CAMLparam1 (data_v);
+    CAMLparam2 (ky_v, iy_v);
     CAMLreturn (Val_unit);
 }
 
@@ -518,9 +1246,9 @@ CAMLprim value ml_os_type (value unit_v)
 #include <errno.h>
 #include <string.h>
 
-CAMLprim value ml_seticon (value data_v)
+CAMLprim value ml_seticon (value ky_v, value iy_v)
 {
-    CAMLparam1 (data_v);
+    CAMLparam2 (ky_v, iy_v);
     CAMLreturn (Val_unit);
 }
 
@@ -597,7 +1325,6 @@ CAMLprim value ml_os_type (value unit_v)
 
 #if defined __linux__ || defined __sun__
 #include <X11/X.h>
-#include <X11/Xmd.h>
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 
@@ -610,60 +1337,141 @@ struct X11State {
     int error;
 };
 
-CAMLprim value ml_seticon (value data_v)
+/* Icon with the bottom ky rows red (kernel load), the rows up to iy
+   yellow (idle load) and black above. The request goes out on GLUT's
+   own connection and is only flushed, nothing waits for the server */
+CAMLprim value ml_seticon (value ky_v, value iy_v)
 {
-    CAMLparam1 (data_v);
+    CAMLparam2 (ky_v, iy_v);
     static struct X11State static_state;
+    /* format 32 property data is an array of longs for Xlib */
+    static unsigned long data[2 + 32 * 32];
     struct X11State *s = &static_state;
-    void *ptr = String_val (data_v);
-    CARD32 *p = ptr;
-    unsigned char *data = ptr;
-
-    if (!s->error) {
-        if (!s->dpy) {
-            s->dpy = XOpenDisplay (NULL);
-            if (!s->dpy) {
-                goto err0;
-            }
-            else {
-                /* "tiny bit" hackish */
-                s->id = glXGetCurrentDrawable ();
-                if (s->id == None) {
-                    goto err1;
-                }
+    int ky = Int_val (ky_v);
+    int iy = Int_val (iy_v);
+    unsigned long color, *p = data + 2;
+    int x, y;
 
-                s->property = XInternAtom (s->dpy, "_NET_WM_ICON", False);
-                if (s->property == None){
-                    goto err1;
-                }
+    if (s->error) {
+        CAMLreturn (Val_unit);
+    }
+
+    if (!s->dpy) {
+        /* "tiny bit" hackish */
+        s->dpy = glXGetCurrentDisplay ();
+        s->id = glXGetCurrentDrawable ();
+        if (!s->dpy || s->id == None) {
+            goto err;
+        }
+
+        s->property = XInternAtom (s->dpy, "_NET_WM_ICON", False);
+        if (s->property == None) {
+            goto err;
+        }
 
 #ifdef DEBUG
-                printf ("id = %#x, property = %d\n",
-                        (int) s->id, (int) s->property);
+        printf ("id = %#x, property = %d\n",
+                (int) s->id, (int) s->property);
 #endif
-            }
-        }
-    }
-    else {
-        CAMLreturn (Val_unit);
     }
 
-    p[0] = 32;
-    p[1] = 32;
+    data[0] = 32;
+    data[1] = 32;
+    for (y = 31; y >= 0; --y) {
+        color = y < ky ? 0xffff0000 : y < iy ? 0xffffff00 : 0xff000000;
+        for (x = 0; x < 32; ++x) {
+            *p++ = color;
+        }
+    }
     XChangeProperty (s->dpy, s->id, s->property, XA_CARDINAL,
-                     32, PropModeReplace, data, 32 * 32 + 2);
+                     32, PropModeReplace, (unsigned char *) data, 2 + 32 * 32);
+    XFlush (s->dpy);
 
     CAMLreturn (Val_unit);
 
- err1:
-    XCloseDisplay (s->dpy);
- err0:
+ err:
     s->error = 1;
     CAMLreturn (Val_unit);
 }
 #endif
 
 #ifndef _WIN32
+#include "ticker.h"
+
+static struct ticker ticker = { -1, 0, 0 };
+
+/* (Re)start the tick scheduler with a period of period_v seconds */
+CAMLprim value ml_ticker_start (value period_v)
+{
+    CAMLparam1 (period_v);
+    uint64_t period = Double_val (period_v) * 1e9;
+
+    if (!period) {
+        failwith_fmt ("ticker period %g is too small", Double_val (period_v));
+    }
+    ticker_stop (&ticker);
+    ticker_start (&ticker, period);
+    CAMLreturn (Val_unit);
+}
+
+/* Number of ticks since the previous call (0 if timeout_v seconds,
+   0.0 meaning forever, passed first) */
+CAMLprim value ml_ticker_wait (value timeout_v)
+{
+    CAMLparam1 (timeout_v);
+    uint64_t timeout = Double_val (timeout_v) * 1e9;
+    int ret, errno_code;
+
+    if (!ticker.period) {
+        failwith ("ticker is not started");
+    }
+
+    caml_enter_blocking_section ();
+    {
+        ret = ticker_wait (&ticker, timeout);
+        errno_code = errno;
+    }
+    caml_leave_blocking_section ();
+
+    if (ret < 0) {
+        failwith_fmt ("ticker_wait: %s", strerror (errno_code));
+    }
+    CAMLreturn (Val_int (ret));
+}
+
+/* Write the whole float64 Bigarray to fd as is */
+CAMLprim value ml_write_floats (value fd_v, value ba_v)
+{
+    CAMLparam2 (fd_v, ba_v);
+    int fd = Int_val (fd_v);
+    const char *p = Caml_ba_data_val (ba_v);
+    size_t n = Caml_ba_array_val (ba_v)->dim[0] * sizeof (double);
+    ssize_t m = 0;
+    int errno_code = 0;
+
+    caml_enter_blocking_section ();
+    {
+        while (n) {
+            m = write (fd, p, n);
+            if (m < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                errno_code = errno;
+                break;
+            }
+            p += m;
+            n -= m;
+        }
+    }
+    caml_leave_blocking_section ();
+
+    if (m < 0) {
+        failwith_fmt ("write: %s", strerror (errno_code));
+    }
+    CAMLreturn (Val_unit);
+}
+
 CAMLprim value ml_waitalrm (value unit_v)
 {
     CAMLparam1 (unit_v);
@@ -791,6 +1599,65 @@ CAMLprim value ml_idletimeofday (value fd_v, value nprocs_v)
     CAMLreturn (Val_unit);
 }
 #endif
+
+CAMLprim value ml_cpuidle_open (value nprocs_v)
+{
+    CAMLparam1 (nprocs_v);
+    CAMLreturn (Val_false);
+}
+
+CAMLprim value ml_stat_into (value ba_v)
+{
+    CAMLparam1 (ba_v);
+    failwith ("stat_into is not implemented on non-Linux");
+    CAMLreturn (Val_unit);
+}
+
+CAMLprim value ml_snapshot (value src_v, value ibuf_v, value kbuf_v,
+                            value ts_v)
+{
+    CAMLparam4 (src_v, ibuf_v, kbuf_v, ts_v);
+    failwith ("snapshot is not implemented on non-Linux");
+    CAMLreturn (Val_unit);
+}
+
+CAMLprim value ml_sampler_start (value src_v, value nprocs_v, value rows_v,
+                                 value period_v, value cpu_v)
+{
+    CAMLparam5 (src_v, nprocs_v, rows_v, period_v, cpu_v);
+    failwith ("sampler thread is not implemented on non-Linux");
+    CAMLreturn (Val_unit);
+}
+
+CAMLprim value ml_sampler_next (value timeout_v, value ibuf_v, value kbuf_v,
+                                value ts_v)
+{
+    CAMLparam4 (timeout_v, ibuf_v, kbuf_v, ts_v);
+    failwith ("sampler thread is not implemented on non-Linux");
+    CAMLreturn (Val_unit);
+}
+
+CAMLprim value ml_shm_publish (value name_v, value nprocs_v, value rows_v,
+                               value period_v)
+{
+    CAMLparam4 (name_v, nprocs_v, rows_v, period_v);
+    failwith ("shm_publish is not implemented on non-Linux");
+    CAMLreturn (Val_unit);
+}
+
+CAMLprim value ml_shm_attach (value name_v)
+{
+    CAMLparam1 (name_v);
+    failwith ("shm_attach is not implemented on non-Linux");
+    CAMLreturn (Val_unit);
+}
+
+CAMLprim value ml_shm_latest (value ibuf_v, value kbuf_v, value ts_v)
+{
+    CAMLparam3 (ibuf_v, kbuf_v, ts_v);
+    failwith ("shm_latest is not implemented on non-Linux");
+    CAMLreturn (Val_unit);
+}
 #endif
 
 CAMLprim value ml_fixwindow (value window_v)
@@ -836,3 +1703,24 @@ CAMLprim value ml_testpmc (value unit_v)
 
     CAMLreturn (Val_bool (pmcok));
 }
+
+/* lablGL has no binding of glTexSubImage2D, the heatmap needs it to
+   replace one column of its texture per sample */
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+
+/* Replace column x_v of the bound GL_TEXTURE_2D with the RGB pixels in
+   ba_v (bottom row first) */
+CAMLprim value ml_tex_column (value x_v, value ba_v)
+{
+    CAMLparam2 (x_v, ba_v);
+    int height = Caml_ba_array_val (ba_v)->dim[0] / 3;
+
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D (GL_TEXTURE_2D, 0, Int_val (x_v), 0, 1, height,
+                     GL_RGB, GL_UNSIGNED_BYTE, Caml_ba_data_val (ba_v));
+    CAMLreturn (Val_unit);
+}
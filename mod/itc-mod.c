@@ -22,12 +22,25 @@
 #include <linux/pm.h>
 #include <linux/miscdevice.h>
 #include <linux/kernel_stat.h>
+#include <linux/timex.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 16)
+#include <linux/ktime.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 28)
+#include <linux/hrtimer.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/log2.h>
+#endif
 #if LINUX_VERSION_CODE < KERNEL_VERSION (3, 0, 0)
 #include <asm/system.h>
 #include <linux/smp_lock.h>
 #endif
 #include <asm/uaccess.h>
 
+#include "itc.h"
+
 #if defined CONFIG_6xx || defined CONFIG_PPC64
 #include <asm/machdep.h>
 #define pm_idle ppc_md.power_save
@@ -59,6 +72,18 @@
     #endif
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 18)
+#define ITC_MMAP
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 28)
+#define ITC_SAMPLER
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION (2, 6, 28)
+#define nr_cpu_ids NR_CPUS
+#endif
+
 #ifdef CONFIG_PREEMPT
 #define itc_enter_bkl() do {                    \
   preempt_disable ();                           \
@@ -88,50 +113,108 @@ module_param (idle_func, long, 0644);
 MODULE_PARM_DESC (idle_func, "address of default idle function");
 #endif
 
+static int overhead;
+#if LINUX_VERSION_CODE < KERNEL_VERSION (2, 6, 0)
+MODULE_PARM (overhead, "i");
+#else
+module_param (overhead, int, 0644);
+#endif
+MODULE_PARM_DESC (overhead, "measure cycles spent in the idle hook");
+
 #define DEVNAME "itc"
-static DEFINE_SPINLOCK (lock);
 
 static void (*orig_pm_idle) (void);
 static unsigned int itc_major;
 
-struct itc
+/* pm_idle is hooked while at least one file is open */
+static DEFINE_SPINLOCK (users_lock);
+static int users;
+
+/* Per open file state, idle times are reported relative to `base'
+   which is taken at open time */
+struct itc_file
 {
-  struct timeval cumm_sleep_time;
-  struct timeval sleep_started;
-  int sleeping;
+#ifdef ITC_SAMPLER
+  struct mutex mutex;         /* serializes sampling setup and reads */
+  spinlock_t lock;            /* protects ring indices and overruns */
+  wait_queue_head_t wait;
+  struct hrtimer timer;
+  ktime_t period;
+  char *ring;
+  size_t sample_size;
+  unsigned int nr_records;
+  unsigned int samples;
+  unsigned int head;
+  unsigned int tail;
+  unsigned int overruns;
+  int tracing;                /* protected by trace_mutex */
+#endif
+  unsigned long *cpus;        /* CPUs to report, NULL for all */
+  u64 now;                    /* time of the snapshot being read */
+  u64 base[1];
 };
 
-static int in_use;
-static struct itc global_itc[NR_CPUS];
+/* Per-CPU counters live in one vmalloc area that can be mapped by
+   userspace. Only the owning CPU ever writes its entry (from the idle
+   path with local interrupts disabled), readers use the sequence
+   counter to get a consistent view without taking any shared lock */
+static struct itc_page *itc_page;
+static size_t itc_page_size;
 
-/**********************************************************************
- *
- * Utility functions
- *
- **********************************************************************/
-static void
-cpeamb (struct timeval *c, struct timeval *a, struct timeval *b)
+/* Self overhead of the hook, only the owning CPU writes its entry */
+struct itc_costs
 {
-  __typeof (c->tv_sec) sec = a->tv_sec - b->tv_sec;
-  __typeof (c->tv_usec) usec = a->tv_usec - b->tv_usec;
+  struct itc_cost enter;
+  struct itc_cost exit;
+} ____cacheline_aligned_in_smp;
 
-  if (usec < 0)
-    {
-      sec -= 1;
-      usec = 1000000 + usec;
-    }
-  c->tv_usec += usec;
-  if (c->tv_usec > 1000000)
+static struct itc_costs *itc_costs;
+
+static inline void
+itc_cost_add (struct itc_cost *c, cycles_t d)
+{
+  c->count++;
+  c->sum += d;
+  if (d < c->min)
     {
-      c->tv_sec += sec + 1;
-      c->tv_usec -= 1000000;
+      c->min = d;
     }
-  else
+  if (d > c->max)
     {
-      c->tv_sec += sec;
+      c->max = d;
     }
 }
 
+static inline void
+itc_write_begin (struct itc_shared *s)
+{
+  s->seq++;
+  smp_wmb ();
+}
+
+static inline void
+itc_write_end (struct itc_shared *s)
+{
+  smp_wmb ();
+  s->seq++;
+}
+
+static inline __u32
+itc_read_seq (struct itc_shared *s)
+{
+  __u32 seq = *(volatile __u32 *) &s->seq;
+
+  smp_rmb ();
+  return seq;
+}
+
+static inline int
+itc_read_retry (struct itc_shared *s, __u32 seq)
+{
+  smp_rmb ();
+  return (seq & 1) || seq != *(volatile __u32 *) &s->seq;
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 0)
 /* XXX: 2.4 */
 /**********************************************************************
@@ -159,45 +242,279 @@ dummy_wakeup (void *unused)
 void default_idle (void);
 #endif
 
+/* Nanoseconds of CLOCK_MONOTONIC, so that userspace can relate our
+   timestamps to its own clock_gettime readings */
+static u64
+itc_monotonic (void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 16)
+  return ktime_to_ns (ktime_get ());
+#else
+  struct timeval tv;
+
+  do_gettimeofday (&tv);
+  return (u64) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/* Consistent copy of CPU's idle time including the sleep in progress
+   up to `now' */
+static u64
+itc_snapshot (int cpu, u64 now)
+{
+  struct itc_shared *itc = &itc_page->cpu[cpu];
+  u64 idle, started;
+  __u32 seq;
+  int sleeping;
+
+  do
+    {
+      seq = itc_read_seq (itc);
+      idle = itc->idle;
+      started = itc->sleep_started;
+      sleeping = itc->sleeping;
+    }
+  while (itc_read_retry (itc, seq));
+
+  if (sleeping && now > started)
+    {
+      idle += now - started;
+    }
+  return idle;
+}
+
+/* Histogram bucket of an idle period lasting `d' nanoseconds */
+static inline int
+itc_hist_bucket (u64 d)
+{
+  int k;
+
+  d >>= ITC_HIST_SHIFT;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 16)
+  k = fls64 (d);
+#else
+  for (k = 0; d; d >>= 1)
+    {
+      k++;
+    }
+#endif
+  return k < ITC_HIST_BUCKETS ? k : ITC_HIST_BUCKETS - 1;
+}
+
+/* Account a finished sleep, called by the owning CPU between
+   itc_write_begin and itc_write_end */
+static inline void
+itc_wakeup (struct itc_shared *itc, u64 now)
+{
+  u64 d = now - itc->sleep_started;
+
+  itc->idle += d;
+  itc->hist[itc_hist_bucket (d)]++;
+  itc->sleeping = 0;
+}
+
+#ifdef ITC_SAMPLER
 static void
-itc_monotonic (struct timeval *tv)
+itc_hist_snapshot (int cpu, struct itc_hist *h)
+{
+  struct itc_shared *itc = &itc_page->cpu[cpu];
+  __u32 seq;
+
+  h->cpu = cpu;
+  h->reserved = 0;
+  do
+    {
+      seq = itc_read_seq (itc);
+      h->entries = itc->entries;
+      memcpy (h->count, itc->hist, sizeof (h->count));
+    }
+  while (itc_read_retry (itc, seq));
+}
+#endif
+
+/* First CPU >= cpu that is present and selected by the file,
+   nr_cpu_ids if none */
+static int
+itc_next_cpu (struct itc_file *itc_file, int cpu)
+{
+  for (; cpu < nr_cpu_ids; ++cpu)
+    {
+      if (itc_file->cpus)
+        {
+          cpu = find_next_bit (itc_file->cpus, nr_cpu_ids, cpu);
+          if (cpu >= nr_cpu_ids)
+            {
+              break;
+            }
+        }
+      if (cpu_present (cpu))
+        {
+          return cpu;
+        }
+    }
+  return nr_cpu_ids;
+}
+
+static unsigned int
+itc_nr_selected (struct itc_file *itc_file)
+{
+  unsigned int n = 0;
+  int cpu;
+
+  for (cpu = itc_next_cpu (itc_file, 0); cpu < nr_cpu_ids;
+       cpu = itc_next_cpu (itc_file, cpu + 1))
+    {
+      n++;
+    }
+  return n;
+}
+
+/* Write up to `max' records of selected CPUs starting with *cpup (idle
+   time relative to the file's base as of `now'), advances *cpup to the
+   next CPU to report and returns the number of records */
+static unsigned int
+itc_fill_records (struct itc_file *itc_file, struct itc_record *rec,
+                  int *cpup, unsigned int max, u64 now)
 {
-  do_gettimeofday (tv);
+  unsigned int n;
+  int cpu = *cpup;
+  u64 idle;
+
+  for (n = 0; n < max && cpu < nr_cpu_ids; ++n)
+    {
+      idle = itc_snapshot (cpu, now);
+      rec[n].cpu = cpu;
+      rec[n].reserved = 0;
+      rec[n].idle = idle > itc_file->base[cpu] ? idle - itc_file->base[cpu] : 0;
+      cpu = itc_next_cpu (itc_file, cpu + 1);
+    }
+  *cpup = cpu;
+  return n;
+}
+
+/* Write header and up to `max' records as of `now' into buf, returns
+   number of bytes */
+static size_t
+itc_fill (struct itc_file *itc_file, void *buf, unsigned int max, u64 now)
+{
+  struct itc_header *hdr = buf;
+  int cpu = itc_next_cpu (itc_file, 0);
+
+  hdr->version = ITC_VERSION;
+  hdr->timestamp = now;
+  hdr->nr_cpus = itc_fill_records (itc_file, (struct itc_record *) (hdr + 1),
+                                   &cpu, max, now);
+  return sizeof (*hdr) + hdr->nr_cpus * sizeof (struct itc_record);
+}
+
+#ifdef ITC_SAMPLER
+/* Idle period trace. Each CPU owns a single producer/single consumer
+   ring: only the CPU itself (with interrupts disabled) advances `head',
+   only the tracer's read advances `tail' */
+struct itc_trace_ring
+{
+  unsigned int head;
+  unsigned int mask;
+  unsigned int lost;
+  u64 overruns;
+  unsigned int tail ____cacheline_aligned;
+  struct itc_event ev[0] ____cacheline_aligned;
+};
+
+static char *itc_trace;
+static size_t itc_trace_stride;
+static struct itc_file *itc_tracer;
+static unsigned int itc_trace_next;
+static DEFINE_MUTEX (trace_mutex);
+
+static inline struct itc_trace_ring *
+itc_trace_ring (char *area, int cpu)
+{
+  return (struct itc_trace_ring *) (area + cpu * itc_trace_stride);
+}
+
+static inline void
+itc_trace_event (int cpu, u64 enter, u64 exit)
+{
+  char *area = ACCESS_ONCE (itc_trace);
+  struct itc_trace_ring *r;
+  struct itc_event *ev;
+  unsigned int head;
+
+  if (!area)
+    {
+      return;
+    }
+
+  r = itc_trace_ring (area, cpu);
+  head = r->head;
+  if (head - ACCESS_ONCE (r->tail) > r->mask)
+    {
+      r->lost++;
+      r->overruns++;
+      return;
+    }
+
+  ev = &r->ev[head & r->mask];
+  ev->cpu = cpu;
+  ev->lost = r->lost;
+  ev->enter = enter;
+  ev->exit = exit;
+  r->lost = 0;
+  smp_wmb ();
+  r->head = head + 1;
 }
+#endif
 
 #ifdef ACCOUNT_IRQ
-static  cputime64_t
+static u64
 itc_irq_time (void)
 {
   struct cpu_usage_stat *cpustat = &kstat_this_cpu.cpustat;
-  return cpustat->irq;
+  struct timeval tv;
+
+  cputime_to_timeval (cpustat->irq, &tv);
+  return (u64) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
 }
 #endif
 
 static void
 itc_idle (void)
 {
-  struct itc *itc;
-  struct timeval tv;
+  struct itc_shared *itc;
+  u64 now;
   unsigned long flags;
+  int measure = overhead;
+  cycles_t c0 = 0, c1 = 0, c2 = 0;
 #ifdef ACCOUNT_IRQ
-  struct timeval tv_irq_before, tv_irq_after;
-  cputime64_t irq_time_before, irq_time_after;
+  u64 irq_time_before, irq_time_after;
 #endif
 
 #ifdef ITC_PREEMPT_HACK
   preempt_disable ();
 #endif
 
+  if (measure)
+    {
+      c0 = get_cycles ();
+    }
   /* printk ("idle in %d\n", smp_processor_id ()); */
-  spin_lock_irqsave (&lock, flags);
-  itc = &global_itc[smp_processor_id ()];
-  itc_monotonic (&itc->sleep_started);
+  itc = &itc_page->cpu[smp_processor_id ()];
+  local_irq_save (flags);
+  itc_write_begin (itc);
+  itc->sleep_started = itc_monotonic ();
   itc->sleeping = 1;
+  itc->entries++;
+  itc_write_end (itc);
 #ifdef ACCOUNT_IRQ
   irq_time_before = itc_irq_time ();
 #endif
-  spin_unlock_irqrestore (&lock, flags);
+  local_irq_restore (flags);
+
+  if (measure)
+    {
+      c1 = get_cycles ();
+    }
 
 #ifdef QUIRK
   if (orig_pm_idle)
@@ -230,23 +547,34 @@ itc_idle (void)
     }
 #endif
 
-  spin_lock_irqsave (&lock, flags);
-  itc_monotonic (&tv);
+  if (measure)
+    {
+      c2 = get_cycles ();
+    }
 
+  local_irq_save (flags);
+  now = itc_monotonic ();
 #ifdef ACCOUNT_IRQ
   irq_time_after = itc_irq_time ();
+#endif
 
-  cputime_to_timeval (irq_time_before, &tv_irq_before);
-  cputime_to_timeval (irq_time_after, &tv_irq_after);
-
-  cpeamb (&itc->cumm_sleep_time, &tv, &itc->sleep_started);
-  cpeamb (&itc->cumm_sleep_time, &tv_irq_before, &tv_irq_after);
-#else
-  cpeamb (&itc->cumm_sleep_time, &tv, &itc->sleep_started);
+  itc_write_begin (itc);
+  itc_wakeup (itc, now);
+#ifdef ACCOUNT_IRQ
+  itc->idle -= irq_time_after - irq_time_before;
 #endif
+  itc_write_end (itc);
+#ifdef ITC_SAMPLER
+  itc_trace_event (smp_processor_id (), itc->sleep_started, now);
+#endif
+  if (measure)
+    {
+      struct itc_costs *cost = &itc_costs[smp_processor_id ()];
 
-  itc->sleeping = 0;
-  spin_unlock_irqrestore (&lock, flags);
+      itc_cost_add (&cost->enter, c1 - c0);
+      itc_cost_add (&cost->exit, get_cycles () - c2);
+    }
+  local_irq_restore (flags);
   /* printk ("idle out %d\n", smp_processor_id ()); */
 
 #ifdef ITC_PREEMPT_HACK
@@ -268,6 +596,19 @@ itc_release (struct inode * inode, struct file * file);
 static ssize_t
 itc_read (struct file * file, char * buf, size_t count, loff_t * ppos);
 
+#ifdef ITC_SAMPLER
+static long
+itc_ioctl (struct file * file, unsigned int cmd, unsigned long arg);
+
+static unsigned int
+itc_poll (struct file * file, poll_table * wait);
+#endif
+
+#ifdef ITC_MMAP
+static int
+itc_mmap (struct file * file, struct vm_area_struct * vma);
+#endif
+
 static struct file_operations itc_fops =
   {
     .owner   = THIS_MODULE,
@@ -275,6 +616,13 @@ static struct file_operations itc_fops =
     .release = itc_release,
     .llseek  = no_llseek,
     .read    = itc_read,
+#ifdef ITC_SAMPLER
+    .unlocked_ioctl = itc_ioctl,
+    .poll    = itc_poll,
+#endif
+#ifdef ITC_MMAP
+    .mmap    = itc_mmap,
+#endif
   };
 
 static struct miscdevice itc_misc_dev =
@@ -284,13 +632,594 @@ static struct miscdevice itc_misc_dev =
     .fops  = &itc_fops
   };
 
+/**********************************************************************
+ *
+ * Kernel timer driven sampling
+ *
+ **********************************************************************/
+#ifdef ITC_SAMPLER
+#define ITC_MIN_PERIOD 10000
+#define ITC_MAX_RING (64 << 20)
+
+static void *
+itc_slot (struct itc_file *itc_file, unsigned int n)
+{
+  n &= itc_file->samples - 1;
+  return itc_file->ring + n * itc_file->sample_size;
+}
+
+static int
+itc_ready (struct itc_file *itc_file)
+{
+  return !ACCESS_ONCE (itc_file->ring)
+    || ACCESS_ONCE (itc_file->head) != ACCESS_ONCE (itc_file->tail);
+}
+
+static enum hrtimer_restart
+itc_tick (struct hrtimer *timer)
+{
+  struct itc_file *itc_file = container_of (timer, struct itc_file, timer);
+  u64 now = ktime_to_ns (hrtimer_get_expires (timer));
+
+  spin_lock (&itc_file->lock);
+  if (itc_file->head - itc_file->tail < itc_file->samples)
+    {
+      itc_fill (itc_file, itc_slot (itc_file, itc_file->head),
+                itc_file->nr_records, now);
+      itc_file->head++;
+    }
+  else
+    {
+      itc_file->overruns++;
+    }
+  spin_unlock (&itc_file->lock);
+  wake_up_interruptible (&itc_file->wait);
+
+  hrtimer_forward_now (timer, itc_file->period);
+  return HRTIMER_RESTART;
+}
+
+/* Both called with itc_file->mutex held */
+static void
+itc_disarm (struct itc_file *itc_file, struct itc_sampling *s)
+{
+  if (itc_file->ring)
+    {
+      hrtimer_cancel (&itc_file->timer);
+      s->overruns = itc_file->overruns;
+      vfree (itc_file->ring);
+      itc_file->ring = NULL;
+      wake_up_interruptible (&itc_file->wait);
+    }
+}
+
+static int
+itc_arm (struct itc_file *itc_file, struct itc_sampling *s)
+{
+  size_t size;
+  char *ring;
+
+  if (s->period < ITC_MIN_PERIOD
+      || s->samples == 0 || s->samples > ITC_MAX_SAMPLES)
+    {
+      return -EINVAL;
+    }
+
+  s->samples = roundup_pow_of_two (s->samples);
+  itc_file->nr_records = itc_nr_selected (itc_file);
+  itc_file->sample_size = sizeof (struct itc_header)
+    + itc_file->nr_records * sizeof (struct itc_record);
+  size = s->samples * itc_file->sample_size;
+  if (size > ITC_MAX_RING)
+    {
+      return -EINVAL;
+    }
+
+  ring = vmalloc (size);
+  if (!ring)
+    {
+      return -ENOMEM;
+    }
+
+  spin_lock_irq (&itc_file->lock);
+  itc_file->ring = ring;
+  itc_file->samples = s->samples;
+  itc_file->head = 0;
+  itc_file->tail = 0;
+  itc_file->overruns = 0;
+  spin_unlock_irq (&itc_file->lock);
+
+  itc_file->period = ns_to_ktime (s->period);
+  hrtimer_start (&itc_file->timer,
+                 ktime_add (ktime_get (), itc_file->period),
+                 HRTIMER_MODE_ABS);
+  return 0;
+}
+
+static ssize_t
+itc_read_samples (struct itc_file *itc_file, struct file *file,
+                  char *buf, size_t count)
+{
+  unsigned int i, n;
+  ssize_t retval;
+
+  for (;;)
+    {
+      if (mutex_lock_interruptible (&itc_file->mutex))
+        {
+          return -ERESTARTSYS;
+        }
+
+      if (!itc_file->ring)
+        {
+          retval = 0;
+          break;
+        }
+
+      if (count < itc_file->sample_size)
+        {
+          retval = -EINVAL;
+          break;
+        }
+
+      spin_lock_irq (&itc_file->lock);
+      n = itc_file->head - itc_file->tail;
+      spin_unlock_irq (&itc_file->lock);
+
+      if (n)
+        {
+          n = min_t (unsigned int, n, count / itc_file->sample_size);
+          for (i = 0; i < n; ++i)
+            {
+              if (copy_to_user (buf + i * itc_file->sample_size,
+                                itc_slot (itc_file, itc_file->tail + i),
+                                itc_file->sample_size))
+                {
+                  break;
+                }
+            }
+
+          spin_lock_irq (&itc_file->lock);
+          itc_file->tail += i;
+          spin_unlock_irq (&itc_file->lock);
+
+          retval = i ? i * itc_file->sample_size : -EFAULT;
+          break;
+        }
+      mutex_unlock (&itc_file->mutex);
+
+      if (file->f_flags & O_NONBLOCK)
+        {
+          return -EAGAIN;
+        }
+
+      if (wait_event_interruptible (itc_file->wait, itc_ready (itc_file)))
+        {
+          return -ERESTARTSYS;
+        }
+    }
+  mutex_unlock (&itc_file->mutex);
+  return retval;
+}
+
+/**********************************************************************
+ *
+ * Idle period trace
+ *
+ **********************************************************************/
+#define ITC_TRACE_POLL_MS 10
+
+/* Both called with trace_mutex held */
+static void
+itc_trace_stop (struct itc_trace *t)
+{
+  char *area = itc_trace;
+  int i;
+
+  t->overruns = 0;
+  if (!area)
+    {
+      return;
+    }
+
+  itc_trace = NULL;
+  itc_tracer->tracing = 0;
+  itc_tracer = NULL;
+  /* producers run with interrupts disabled */
+  synchronize_sched ();
+  for (i = 0; i < nr_cpu_ids; ++i)
+    {
+      t->overruns += itc_trace_ring (area, i)->overruns;
+    }
+  vfree (area);
+}
+
+static int
+itc_trace_start (struct itc_file *itc_file, struct itc_trace *t)
+{
+  size_t size;
+  char *area;
+  int i;
+
+  if (t->events > ITC_MAX_TRACE_EVENTS)
+    {
+      return -EINVAL;
+    }
+
+  t->events = roundup_pow_of_two (t->events);
+  itc_trace_stride = ALIGN (sizeof (struct itc_trace_ring)
+                            + t->events * sizeof (struct itc_event),
+                            L1_CACHE_BYTES);
+  size = nr_cpu_ids * itc_trace_stride;
+  if (size > ITC_MAX_RING)
+    {
+      return -EINVAL;
+    }
+
+  area = vmalloc (size);
+  if (!area)
+    {
+      return -ENOMEM;
+    }
+  memset (area, 0, size);
+  for (i = 0; i < nr_cpu_ids; ++i)
+    {
+      itc_trace_ring (area, i)->mask = t->events - 1;
+    }
+
+  itc_tracer = itc_file;
+  itc_file->tracing = 1;
+  itc_trace_next = 0;
+  smp_wmb ();
+  itc_trace = area;
+  return 0;
+}
+
+static long
+itc_trace_ioctl (struct itc_file *itc_file, unsigned int cmd,
+                 unsigned long arg)
+{
+  struct itc_trace t;
+  long ret = 0;
+  int i;
+
+  if (cmd == ITC_IOC_TRACE
+      && copy_from_user (&t, (void __user *) arg, sizeof (t)))
+    {
+      return -EFAULT;
+    }
+
+  mutex_lock (&trace_mutex);
+  if (cmd == ITC_IOC_TRACE)
+    {
+      if (itc_tracer && itc_tracer != itc_file)
+        {
+          ret = -EBUSY;
+        }
+      else
+        {
+          itc_trace_stop (&t);
+          if (t.events)
+            {
+              ret = itc_trace_start (itc_file, &t);
+            }
+        }
+    }
+  else
+    {
+      t.events = 0;
+      t.overruns = 0;
+      if (itc_trace)
+        {
+          t.events = itc_trace_ring (itc_trace, 0)->mask + 1;
+          for (i = 0; i < nr_cpu_ids; ++i)
+            {
+              t.overruns += itc_trace_ring (itc_trace, i)->overruns;
+            }
+        }
+    }
+  mutex_unlock (&trace_mutex);
+
+  t.reserved = 0;
+  if (!ret && copy_to_user ((void __user *) arg, &t, sizeof (t)))
+    {
+      ret = -EFAULT;
+    }
+  return ret;
+}
+
+/* Copy whole events from the CPUs' rings, starting with a different
+   CPU every time so that a small buffer does not starve anyone */
+static ssize_t
+itc_read_trace (struct itc_file *itc_file, struct file *file,
+                char *buf, size_t count)
+{
+  struct itc_trace_ring *r;
+  unsigned int head, tail, n;
+  size_t max = count / sizeof (struct itc_event), done = 0;
+  ssize_t retval = 0;
+  int i, cpu;
+
+  if (!max)
+    {
+      return -EINVAL;
+    }
+
+  for (;;)
+    {
+      if (mutex_lock_interruptible (&trace_mutex))
+        {
+          return -ERESTARTSYS;
+        }
+
+      if (!itc_file->tracing)
+        {
+          break;
+        }
+
+      for (i = 0; i < nr_cpu_ids && done < max; ++i)
+        {
+          cpu = (itc_trace_next + i) % nr_cpu_ids;
+          r = itc_trace_ring (itc_trace, cpu);
+          head = ACCESS_ONCE (r->head);
+          smp_rmb ();
+          for (tail = r->tail; tail != head && done < max; tail += n)
+            {
+              n = min_t (unsigned int, head - tail,
+                         r->mask + 1 - (tail & r->mask));
+              n = min_t (size_t, n, max - done);
+              if (copy_to_user (buf + done * sizeof (struct itc_event),
+                                &r->ev[tail & r->mask],
+                                n * sizeof (struct itc_event)))
+                {
+                  retval = -EFAULT;
+                  break;
+                }
+              done += n;
+            }
+          smp_mb ();
+          r->tail = tail;
+          if (retval)
+            {
+              break;
+            }
+        }
+      itc_trace_next = (itc_trace_next + 1) % nr_cpu_ids;
+
+      if (done || retval)
+        {
+          break;
+        }
+      mutex_unlock (&trace_mutex);
+
+      if (file->f_flags & O_NONBLOCK)
+        {
+          return -EAGAIN;
+        }
+
+      /* producers run in the idle loop and never wake us up */
+      if (msleep_interruptible (ITC_TRACE_POLL_MS))
+        {
+          return -ERESTARTSYS;
+        }
+    }
+  mutex_unlock (&trace_mutex);
+  return done ? done * sizeof (struct itc_event) : retval;
+}
+
+/**********************************************************************
+ *
+ * CPU selection
+ *
+ **********************************************************************/
+/* Called with itc_file->mutex held */
+static int
+itc_select (struct itc_file *itc_file, struct file *file,
+            struct itc_cpus *c)
+{
+  const __u64 __user *mask = (const __u64 __user *) (unsigned long) c->mask;
+  unsigned int nbits = min_t (__u32, c->nr_cpus, nr_cpu_ids);
+  unsigned long *cpus = NULL;
+  unsigned int i, bit;
+  __u64 w;
+
+  if (itc_file->ring)
+    {
+      return -EBUSY;
+    }
+
+  if (c->nr_cpus)
+    {
+      cpus = kzalloc (BITS_TO_LONGS (nr_cpu_ids) * sizeof (long), GFP_KERNEL);
+      if (!cpus)
+        {
+          return -ENOMEM;
+        }
+
+      for (i = 0; i * 64 < nbits; ++i)
+        {
+          if (copy_from_user (&w, mask + i, sizeof (w)))
+            {
+              kfree (cpus);
+              return -EFAULT;
+            }
+          for (bit = i * 64; w && bit < nbits; ++bit, w >>= 1)
+            {
+              if (w & 1)
+                {
+                  __set_bit (bit, cpus);
+                }
+            }
+        }
+    }
+
+  kfree (itc_file->cpus);
+  itc_file->cpus = cpus;
+  file->f_pos = 0;
+  return 0;
+}
+
+static long
+itc_ioctl (struct file *file, unsigned int cmd, unsigned long arg)
+{
+  struct itc_file *itc_file = file->private_data;
+  struct itc_sampling s;
+  struct itc_hist h;
+  struct itc_cpus c;
+  struct itc_overhead o;
+  long ret = 0;
+
+  switch (cmd)
+    {
+    case ITC_IOC_OVERHEAD:
+      if (get_user (o.cpu, (__u32 __user *) arg))
+        {
+          return -EFAULT;
+        }
+      if (o.cpu >= nr_cpu_ids || !cpu_present (o.cpu))
+        {
+          return -EINVAL;
+        }
+      o.reserved = 0;
+      o.enter = itc_costs[o.cpu].enter;
+      o.exit = itc_costs[o.cpu].exit;
+      if (copy_to_user ((void __user *) arg, &o, sizeof (o)))
+        {
+          return -EFAULT;
+        }
+      return 0;
+
+    case ITC_IOC_CPUS:
+      if (copy_from_user (&c, (void __user *) arg, sizeof (c)))
+        {
+          return -EFAULT;
+        }
+      mutex_lock (&itc_file->mutex);
+      ret = itc_select (itc_file, file, &c);
+      mutex_unlock (&itc_file->mutex);
+      return ret;
+
+    case ITC_IOC_TRACE:
+    case ITC_IOC_TRACE_STATUS:
+      return itc_trace_ioctl (itc_file, cmd, arg);
+
+    case ITC_IOC_HIST:
+      if (get_user (h.cpu, (__u32 __user *) arg))
+        {
+          return -EFAULT;
+        }
+      if (h.cpu >= nr_cpu_ids || !cpu_present (h.cpu))
+        {
+          return -EINVAL;
+        }
+      itc_hist_snapshot (h.cpu, &h);
+      if (copy_to_user ((void __user *) arg, &h, sizeof (h)))
+        {
+          return -EFAULT;
+        }
+      return 0;
+
+    case ITC_IOC_SAMPLE:
+      if (copy_from_user (&s, (void __user *) arg, sizeof (s)))
+        {
+          return -EFAULT;
+        }
+      mutex_lock (&itc_file->mutex);
+      s.overruns = 0;
+      itc_disarm (itc_file, &s);
+      if (s.period)
+        {
+          ret = itc_arm (itc_file, &s);
+        }
+      mutex_unlock (&itc_file->mutex);
+      break;
+
+    case ITC_IOC_STATUS:
+      mutex_lock (&itc_file->mutex);
+      s.period = itc_file->ring ? ktime_to_ns (itc_file->period) : 0;
+      s.samples = itc_file->ring ? itc_file->samples : 0;
+      spin_lock_irq (&itc_file->lock);
+      s.overruns = itc_file->overruns;
+      spin_unlock_irq (&itc_file->lock);
+      mutex_unlock (&itc_file->mutex);
+      break;
+
+    default:
+      return -ENOTTY;
+    }
+
+  if (!ret && copy_to_user ((void __user *) arg, &s, sizeof (s)))
+    {
+      ret = -EFAULT;
+    }
+  return ret;
+}
+
+/* A tracing file is readable while some CPU's ring holds events, the
+   producers never wake the poller (see ITC_IOC_TRACE) */
+static unsigned int
+itc_poll (struct file *file, poll_table *wait)
+{
+  struct itc_file *itc_file = file->private_data;
+  struct itc_trace_ring *r;
+  unsigned int mask = 0;
+  int cpu;
+
+  mutex_lock (&trace_mutex);
+  if (itc_file->tracing)
+    {
+      for (cpu = 0; cpu < nr_cpu_ids && !mask; ++cpu)
+        {
+          r = itc_trace_ring (itc_trace, cpu);
+          if (ACCESS_ONCE (r->head) != r->tail)
+            {
+              mask = POLLIN | POLLRDNORM;
+            }
+        }
+      mutex_unlock (&trace_mutex);
+      return mask;
+    }
+  mutex_unlock (&trace_mutex);
+
+  poll_wait (file, &itc_file->wait, wait);
+  return itc_ready (itc_file) ? POLLIN | POLLRDNORM : 0;
+}
+#endif
+
 static int
 itc_release (struct inode * inode, struct file * filp)
 {
-  itc_enter_bkl ();
-  pm_idle = orig_pm_idle;
-  in_use = 0;
-  itc_leave_bkl ();
+  struct itc_file *itc_file = filp->private_data;
+#ifdef ITC_SAMPLER
+  struct itc_sampling s;
+  struct itc_trace t;
+#endif
+  int last;
+
+#ifdef ITC_SAMPLER
+  mutex_lock (&trace_mutex);
+  if (itc_file->tracing)
+    {
+      itc_trace_stop (&t);
+    }
+  mutex_unlock (&trace_mutex);
+  itc_disarm (itc_file, &s);
+#endif
+  kfree (itc_file->cpus);
+  kfree (itc_file);
+
+  spin_lock (&users_lock);
+  last = --users == 0;
+  if (last)
+    {
+      pm_idle = orig_pm_idle;
+    }
+  spin_unlock (&users_lock);
+
+  if (!last)
+    {
+      return 0;
+    }
 #if LINUX_VERSION_CODE >= KERNEL_VERSION (2, 6, 0)
   /* XXX: 2.4 */
 #if LINUX_VERSION_CODE > KERNEL_VERSION (2, 6, 26)
@@ -306,7 +1235,9 @@ itc_release (struct inode * inode, struct file * filp)
 static int
 itc_open (struct inode * inode, struct file * filp)
 {
-  int ret = 0;
+  int i;
+  u64 now;
+  struct itc_file *itc_file;
   unsigned int minor = iminor (inode);
 
   if (itc_major)
@@ -317,75 +1248,159 @@ itc_open (struct inode * inode, struct file * filp)
         }
     }
 
-  if (in_use)
+  itc_file = kmalloc (sizeof (*itc_file)
+                      + (nr_cpu_ids - 1) * sizeof (itc_file->base[0]),
+                      GFP_KERNEL);
+  if (!itc_file)
     {
-      return -EALREADY;
+      return -ENOMEM;
     }
 
   filp->f_op = &itc_fops;
+  filp->private_data = itc_file;
+  itc_file->cpus = NULL;
+#ifdef ITC_SAMPLER
+  mutex_init (&itc_file->mutex);
+  spin_lock_init (&itc_file->lock);
+  init_waitqueue_head (&itc_file->wait);
+  hrtimer_init (&itc_file->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+  itc_file->timer.function = itc_tick;
+  itc_file->ring = NULL;
+  itc_file->tracing = 0;
+#endif
 
-  itc_enter_bkl ();
-  if (pm_idle != itc_idle)
+  spin_lock (&users_lock);
+  if (users++ == 0)
     {
-      orig_pm_idle = pm_idle;
+      if (pm_idle != itc_idle)
+        {
+          orig_pm_idle = pm_idle;
+        }
+      pm_idle = itc_idle;
     }
-  pm_idle = itc_idle;
-  in_use = 1;
-  itc_leave_bkl ();
+  spin_unlock (&users_lock);
 
-  return ret;
+  now = itc_monotonic ();
+  for (i = 0; i < nr_cpu_ids; ++i)
+    {
+      itc_file->base[i] = itc_snapshot (i, now);
+    }
+
+  return 0;
 }
 
+/* A snapshot is the header followed by the records of all selected
+   CPUs. It can be read in pieces: *ppos is zero when a new snapshot
+   is to be started and the next CPU to report plus one otherwise, all
+   pieces use the time taken at the start */
+#define ITC_CHUNK 16
+
 static ssize_t
-itc_read (struct file *file, char * buf, size_t count, loff_t * ppos)
+itc_read_snapshot (struct itc_file *itc_file, char *buf, size_t count,
+                   loff_t *ppos)
 {
-  int i;
-  size_t itemsize = sizeof (global_itc[0].cumm_sleep_time);
-  ssize_t retval = 0;
-  unsigned long flags;
-  struct itc *itc = &global_itc[0];
-  struct timeval tmp[NR_CPUS], *tmpp;
+  size_t itemsize = sizeof (struct itc_record);
+  size_t done = 0;
+  unsigned int n;
+  int cpu, first;
+  struct itc_record rec[ITC_CHUNK];
+  struct itc_header hdr;
 
-  tmpp = tmp;
-  if (count < itemsize * num_present_cpus ())
+  if (*ppos == 0)
     {
-      printk (KERN_ERR
-              "attempt to read something funny %zu expected %zu(%zu,%u)\n",
-              count, itemsize * num_present_cpus (),
-              itemsize, num_present_cpus ());
-      return -EINVAL;
+      hdr.version = ITC_VERSION;
+      hdr.nr_cpus = itc_nr_selected (itc_file);
+      hdr.timestamp = itc_monotonic ();
+      if (count < sizeof (hdr) + (hdr.nr_cpus ? itemsize : 0))
+        {
+          return -EINVAL;
+        }
+
+      if (copy_to_user (buf, &hdr, sizeof (hdr)))
+        {
+          return -EFAULT;
+        }
+      done = sizeof (hdr);
+      itc_file->now = hdr.timestamp;
+      cpu = itc_next_cpu (itc_file, 0);
+    }
+  else
+    {
+      cpu = *ppos - 1;
     }
 
-  spin_lock_irqsave (&lock, flags);
-  for (i = 0; i < NR_CPUS; ++i, ++itc)
+  while (cpu < nr_cpu_ids && count - done >= itemsize)
     {
-      if (cpu_present (i))
+      first = cpu;
+      n = min_t (size_t, ITC_CHUNK, (count - done) / itemsize);
+      n = itc_fill_records (itc_file, rec, &cpu, n, itc_file->now);
+      if (copy_to_user (buf + done, rec, n * itemsize))
         {
-          if (itc->sleeping)
+          if (!done)
             {
-              struct timeval tv;
-
-              itc_monotonic (&tv);
-              cpeamb (&itc->cumm_sleep_time, &tv, &itc->sleep_started);
-              itc->sleep_started.tv_sec = tv.tv_sec;
-              itc->sleep_started.tv_usec = tv.tv_usec;
+              return -EFAULT;
             }
-
-          *tmpp++ = itc->cumm_sleep_time;
-          retval += itemsize;
+          cpu = first;
+          break;
         }
+      done += n * itemsize;
+    }
+
+  *ppos = cpu < nr_cpu_ids ? cpu + 1 : 0;
+  return done;
+}
+
+static ssize_t
+itc_read (struct file *file, char * buf, size_t count, loff_t * ppos)
+{
+  struct itc_file *itc_file = file->private_data;
+  ssize_t retval;
+
+#ifdef ITC_SAMPLER
+  if (itc_file->tracing)
+    {
+      return itc_read_trace (itc_file, file, buf, count);
     }
-  spin_unlock_irqrestore (&lock, flags);
 
-  if (copy_to_user (buf, tmp, retval))
+  if (itc_file->ring)
     {
-      printk (KERN_ERR "failed to write %zu bytes to %p\n",
-              retval, buf);
-      retval = -EFAULT;
+      return itc_read_samples (itc_file, file, buf, count);
     }
+#endif
+  /* the mutex keeps ITC_IOC_CPUS away while a snapshot is read */
+#ifdef ITC_SAMPLER
+  if (mutex_lock_interruptible (&itc_file->mutex))
+    {
+      return -ERESTARTSYS;
+    }
+#endif
+  retval = itc_read_snapshot (itc_file, buf, count, ppos);
+#ifdef ITC_SAMPLER
+  mutex_unlock (&itc_file->mutex);
+#endif
   return retval;
 }
 
+#ifdef ITC_MMAP
+static int
+itc_mmap (struct file *file, struct vm_area_struct *vma)
+{
+  if (vma->vm_pgoff != 0
+      || vma->vm_end - vma->vm_start > PAGE_ALIGN (itc_page_size))
+    {
+      return -EINVAL;
+    }
+
+  if (vma->vm_flags & VM_WRITE)
+    {
+      return -EPERM;
+    }
+  vma->vm_flags &= ~VM_MAYWRITE;
+
+  return remap_vmalloc_range (vma, itc_page, 0);
+}
+#endif
+
 /**********************************************************************
  *
  * Module constructor
@@ -394,7 +1409,7 @@ itc_read (struct file *file, char * buf, size_t count, loff_t * ppos)
 static __init int
 init (void)
 {
-  int err;
+  int err, i;
 
 #ifdef CONFIG_X86
   fidle_func = (void (*) (void)) idle_func;
@@ -416,6 +1431,39 @@ init (void)
     }
 #endif
 
+  itc_page_size = sizeof (*itc_page) + nr_cpu_ids * sizeof (itc_page->cpu[0]);
+#ifdef ITC_MMAP
+  itc_page = vmalloc_user (itc_page_size);
+#else
+  itc_page = vmalloc (itc_page_size);
+  if (itc_page)
+    {
+      memset (itc_page, 0, itc_page_size);
+    }
+#endif
+  if (!itc_page)
+    {
+      printk (KERN_ERR "itc: could not allocate %zu bytes\n", itc_page_size);
+      return -ENOMEM;
+    }
+  itc_page->version = ITC_VERSION;
+  itc_page->nr_cpus = nr_cpu_ids;
+  itc_page->entry_size = sizeof (itc_page->cpu[0]);
+
+  itc_costs = vmalloc (nr_cpu_ids * sizeof (*itc_costs));
+  if (!itc_costs)
+    {
+      printk (KERN_ERR "itc: could not allocate overhead counters\n");
+      vfree (itc_page);
+      return -ENOMEM;
+    }
+  memset (itc_costs, 0, nr_cpu_ids * sizeof (*itc_costs));
+  for (i = 0; i < nr_cpu_ids; ++i)
+    {
+      itc_costs[i].enter.min = ~0ULL;
+      itc_costs[i].exit.min = ~0ULL;
+    }
+
   if (itc_major)
     {
       err = register_chrdev (itc_major, DEVNAME, &itc_fops);
@@ -423,6 +1471,8 @@ init (void)
         {
           printk (KERN_ERR "itc: register_chrdev failed itc_major=%d err=%d\n",
                   itc_major, err);
+          vfree (itc_costs);
+          vfree (itc_page);
           return -ENODEV;
         }
 
@@ -437,6 +1487,8 @@ init (void)
       if (err < 0)
         {
           printk (KERN_ERR "itc: misc_register failed err=%d\n", err);
+          vfree (itc_costs);
+          vfree (itc_page);
           return err;
         }
     }
@@ -495,6 +1547,8 @@ fini (void)
     {
       misc_deregister (&itc_misc_dev);
     }
+  vfree (itc_costs);
+  vfree (itc_page);
   printk (KERN_DEBUG "itc: unloaded\n");
 }
 
@@ -0,0 +1,265 @@
+/* Binary interface of /dev/itc shared by the module and its users */
+#ifndef ITC_H
+#define ITC_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define ITC_VERSION 2
+
+/* read(2) returns one header followed by nr_cpus records, one per
+   present CPU (or per selected one, see ITC_IOC_CPUS) in increasing
+   CPU order. A buffer too small for all records gets as many as fit
+   and the following reads continue the same snapshot, so a snapshot
+   can be consumed in pieces of any size down to a single record. All
+   times are in nanoseconds of the clock behind clock_gettime
+   (CLOCK_MONOTONIC), idle times count from the moment the file was
+   opened */
+struct itc_header
+{
+  __u32 version;
+  __u32 nr_cpus;
+  __u64 timestamp;
+};
+
+struct itc_record
+{
+  __u32 cpu;
+  __u32 reserved;
+  __u64 idle;
+};
+
+/* ITC_IOC_SAMPLE arms (period != 0) or disarms periodic sampling by a
+   kernel timer. While armed every expiry queues a complete snapshot
+   (header with the expiry time as timestamp plus records) into a ring
+   of `samples' entries, read(2) drains as many whole snapshots as fit
+   (blocking unless O_NONBLOCK) and poll(2) reports POLLIN while the
+   ring is not empty. Snapshots that find the ring full are dropped and
+   counted in `overruns' which ITC_IOC_SAMPLE returns for the previous
+   arming and ITC_IOC_STATUS for the current one */
+struct itc_sampling
+{
+  __u64 period;
+  __u32 samples;
+  __u32 overruns;
+};
+
+#define ITC_IOC_MAGIC 'i'
+#define ITC_IOC_SAMPLE _IOWR (ITC_IOC_MAGIC, 1, struct itc_sampling)
+#define ITC_IOC_STATUS _IOR (ITC_IOC_MAGIC, 2, struct itc_sampling)
+
+#define ITC_MAX_SAMPLES 65536
+
+/* Every completed idle period of length d nanoseconds is counted in
+   bucket 0 if d < 1024, in bucket ITC_HIST_BUCKETS-1 if d >= 2^32 and
+   in bucket k with 2^(k+9) <= d < 2^(k+10) otherwise, i.e. from below
+   a microsecond to seconds in powers of two. `entries' counts times
+   the CPU went idle. Counts run from module load, users are expected
+   to take differences. ITC_IOC_HIST fills the structure for `cpu' */
+#define ITC_HIST_BUCKETS 24
+#define ITC_HIST_SHIFT 10
+
+struct itc_hist
+{
+  __u32 cpu;
+  __u32 reserved;
+  __u64 entries;
+  __u64 count[ITC_HIST_BUCKETS];
+};
+
+#define ITC_IOC_HIST _IOWR (ITC_IOC_MAGIC, 3, struct itc_hist)
+
+/* ITC_IOC_TRACE with `events' != 0 makes the file the (only) tracer:
+   every CPU records its idle periods into a private ring of `events'
+   entries (rounded up to a power of two) and read(2) on the file
+   returns whole itc_event records instead of snapshots, sleeping
+   until some are available unless O_NONBLOCK is set. poll(2) reports
+   POLLIN while some ring holds events, but nothing wakes a poll that
+   found them all empty, so it needs a timeout. Events are
+   grouped by CPU and ordered within a CPU only. A CPU whose ring is
+   full drops events, the number dropped right before an event is in
+   its `lost' field. `events' == 0 stops tracing, both forms return
+   the total number of dropped events of the stopped session in
+   `overruns', ITC_IOC_TRACE_STATUS the settings and drops so far */
+struct itc_trace
+{
+  __u32 events;
+  __u32 reserved;
+  __u64 overruns;
+};
+
+struct itc_event
+{
+  __u32 cpu;
+  __u32 lost;
+  __u64 enter;
+  __u64 exit;
+};
+
+#define ITC_IOC_TRACE _IOWR (ITC_IOC_MAGIC, 4, struct itc_trace)
+#define ITC_IOC_TRACE_STATUS _IOR (ITC_IOC_MAGIC, 5, struct itc_trace)
+
+#define ITC_MAX_TRACE_EVENTS 65536
+
+/* ITC_IOC_CPUS restricts read(2) snapshots and timer samples of the
+   file to the CPUs whose bits are set in the array of nr_cpus bits
+   (64 per __u64 word) that `mask' points to, nr_cpus == 0 selects all
+   present CPUs again. Fails with EBUSY while sampling is armed */
+struct itc_cpus
+{
+  __u32 nr_cpus;
+  __u32 reserved;
+  __u64 mask;
+};
+
+#define ITC_IOC_CPUS _IOW (ITC_IOC_MAGIC, 6, struct itc_cpus)
+
+/* While the module parameter `overhead' is set the idle hook measures
+   the time (in get_cycles units) it adds in front of the idle routine
+   (`enter') and after it (`exit'). ITC_IOC_OVERHEAD returns the totals
+   for `cpu', they are debugging aids and not read atomically */
+struct itc_cost
+{
+  __u64 count;
+  __u64 sum;
+  __u64 min;
+  __u64 max;
+};
+
+struct itc_overhead
+{
+  __u32 cpu;
+  __u32 reserved;
+  struct itc_cost enter;
+  struct itc_cost exit;
+};
+
+#define ITC_IOC_OVERHEAD _IOWR (ITC_IOC_MAGIC, 7, struct itc_overhead)
+
+/* mmap(2) of the device (read only, offset 0) exposes itc_page followed
+   by nr_cpus entries of entry_size bytes indexed by CPU number. Every
+   entry is written by its own CPU only, `seq' is odd while an update
+   is in progress. While `sleeping' is set `idle' does not include the
+   sleep that began at `sleep_started'. `entries' and `hist' are as in
+   struct itc_hist */
+#define ITC_SHARED_SIZE 256
+
+struct itc_shared
+{
+  __u32 seq;
+  __u32 sleeping;
+  __u64 idle;
+  __u64 sleep_started;
+  __u64 entries;
+  __u64 hist[ITC_HIST_BUCKETS];
+  __u8 pad[ITC_SHARED_SIZE - 32 - ITC_HIST_BUCKETS * 8];
+};
+
+struct itc_page
+{
+  __u32 version;
+  __u32 nr_cpus;
+  __u32 entry_size;
+  __u8 pad[ITC_SHARED_SIZE - 12];
+  struct itc_shared cpu[];
+};
+
+#ifndef __KERNEL__
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define itc_page_entry(page, n)                                 \
+  ((const volatile struct itc_shared *)                         \
+   ((const char *) (page)->cpu + (n) * (page)->entry_size))
+
+static inline __u64
+itc_clock (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (__u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Map the counters of an open /dev/itc, NULL (with errno set) if the
+   module does not support it */
+static inline struct itc_page *
+itc_mmap (int fd, size_t *lenp)
+{
+  struct itc_page *page;
+  size_t len = sysconf (_SC_PAGESIZE), need;
+
+  page = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  if (page == MAP_FAILED)
+    return NULL;
+
+  if (page->version != ITC_VERSION)
+    {
+      munmap (page, len);
+      errno = EPROTO;
+      return NULL;
+    }
+
+  need = sizeof (*page) + page->nr_cpus * page->entry_size;
+  if (need > len)
+    {
+      munmap (page, len);
+      len = need;
+      page = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+      if (page == MAP_FAILED)
+        return NULL;
+    }
+
+  *lenp = len;
+  return page;
+}
+
+/* Idle time of CPU `n' including the sleep in progress up to `now' */
+static inline __u64
+itc_page_idle (const struct itc_page *page, int n, __u64 now)
+{
+  const volatile struct itc_shared *s = itc_page_entry (page, n);
+  __u64 idle, started;
+  __u32 seq, sleeping;
+
+  do
+    {
+      seq = s->seq;
+      __sync_synchronize ();
+      idle = s->idle;
+      started = s->sleep_started;
+      sleeping = s->sleeping;
+      __sync_synchronize ();
+    }
+  while ((seq & 1) || seq != s->seq);
+
+  if (sleeping && now > started)
+    idle += now - started;
+  return idle;
+}
+
+static inline void
+itc_page_hist (const struct itc_page *page, int n, struct itc_hist *h)
+{
+  const volatile struct itc_shared *s = itc_page_entry (page, n);
+  __u32 seq;
+  int i;
+
+  h->cpu = n;
+  h->reserved = 0;
+  do
+    {
+      seq = s->seq;
+      __sync_synchronize ();
+      h->entries = s->entries;
+      for (i = 0; i < ITC_HIST_BUCKETS; ++i)
+        h->count[i] = s->hist[i];
+      __sync_synchronize ();
+    }
+  while ((seq & 1) || seq != s->seq);
+}
+#endif
+
+#endif
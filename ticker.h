@@ -0,0 +1,151 @@
+/* Periodic ticks on the absolute deadlines start + k * period of the
+   monotonic clock: a late wake up does not move the following ones,
+   so ticks never drift, and deadlines that passed while nobody was
+   waiting are counted rather than silently skipped. A timerfd does the
+   bookkeeping where the kernel has one, clock_nanosleep (TIMER_ABSTIME)
+   otherwise. Nothing here involves signals */
+#ifndef TICKER_H
+#define TICKER_H
+
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#if defined __linux__ && defined __GLIBC__ \
+  && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 8))
+#define TICKER_TIMERFD
+#include <poll.h>
+#include <sys/timerfd.h>
+#endif
+
+#ifdef __APPLE__
+#include <sys/time.h>
+#endif
+
+struct ticker
+{
+  int fd;                       /* timerfd or -1 */
+  uint64_t period;
+  uint64_t next;                /* used without a timerfd */
+};
+
+static inline uint64_t
+ticker_clock (void)
+{
+#ifdef __APPLE__
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#else
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline void
+ticker_timespec (struct timespec *ts, uint64_t ns)
+{
+  ts->tv_sec = ns / 1000000000;
+  ts->tv_nsec = ns % 1000000000;
+}
+
+/* First tick one period (in nanoseconds, non zero) from now */
+static inline void
+ticker_start (struct ticker *t, uint64_t period)
+{
+  t->period = period;
+  t->next = ticker_clock () + period;
+  t->fd = -1;
+
+#ifdef TICKER_TIMERFD
+  t->fd = timerfd_create (CLOCK_MONOTONIC, 0);
+  if (t->fd >= 0)
+    {
+      struct itimerspec its;
+
+      ticker_timespec (&its.it_value, t->next);
+      ticker_timespec (&its.it_interval, period);
+      if (timerfd_settime (t->fd, TFD_TIMER_ABSTIME, &its, NULL))
+        {
+          close (t->fd);
+          t->fd = -1;
+        }
+    }
+#endif
+}
+
+static inline void
+ticker_stop (struct ticker *t)
+{
+  if (t->fd >= 0)
+    close (t->fd);
+  t->fd = -1;
+  t->period = 0;
+}
+
+/* Sleep until the next deadline but no longer than `timeout'
+   nanoseconds (0 means no limit). Returns the number of deadlines
+   passed since the previous call, i.e. 1 plus the number of missed
+   ticks, 0 if the timeout (or a signal) came first and -1 (with errno
+   set) on error */
+static inline int
+ticker_wait (struct ticker *t, uint64_t timeout)
+{
+  uint64_t now, until, n;
+  struct timespec ts;
+
+#ifdef TICKER_TIMERFD
+  if (t->fd >= 0)
+    {
+      struct pollfd pfd;
+      int ret;
+
+      pfd.fd = t->fd;
+      pfd.events = POLLIN;
+      ret = poll (&pfd, 1,
+                  timeout ? (int) ((timeout + 999999) / 1000000) : -1);
+      if (ret <= 0)
+        return ret < 0 && errno != EINTR ? -1 : 0;
+
+      if (read (t->fd, &n, sizeof (n)) != sizeof (n))
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+      return n;
+    }
+#endif
+
+  now = ticker_clock ();
+  if (now < t->next)
+    {
+      until = t->next;
+      if (timeout && now + timeout < until)
+        until = now + timeout;
+
+#ifdef __APPLE__
+      ticker_timespec (&ts, until - now);
+      if (nanosleep (&ts, NULL) && errno != EINTR)
+        return -1;
+#else
+      ticker_timespec (&ts, until);
+      n = clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+      if (n && n != EINTR)
+        {
+          errno = n;
+          return -1;
+        }
+#endif
+
+      now = ticker_clock ();
+      if (now < t->next)
+        return 0;
+    }
+
+  n = (now - t->next) / t->period + 1;
+  t->next += n * t->period;
+  return n;
+}
+
+#endif
@@ -0,0 +1,90 @@
+/* cc -o wakelat wakelat.c -lrt */
+/* Measures how late a sleeping thread wakes up after its deadline,
+   i.e. (mostly) the cost of getting an idle CPU back to work. With
+   `-d /dev/itc' the device is kept open for the duration of the run
+   so that the idle hook of the module is installed */
+#define _GNU_SOURCE
+#include <err.h>
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static uint64_t now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main (int argc, char **argv)
+{
+    int i, fd = -1;
+    int n = 10000;
+    int period = 1000;
+    const char *dev = NULL;
+    uint64_t *late, deadline, sum = 0;
+    struct timespec ts;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp (argv[i], "-d")) {
+            if (++i == argc) errx (1, "-d requires a device name");
+            dev = argv[i];
+        }
+        else if (!strcmp (argv[i], "-n")) {
+            if (++i == argc) errx (1, "-n requires a number");
+            n = atoi (argv[i]);
+        }
+        else if (!strcmp (argv[i], "-p")) {
+            if (++i == argc) errx (1, "-p requires a number");
+            period = atoi (argv[i]);
+        }
+        else
+            errx (1, "usage: %s [-d device] [-n iterations] [-p period_us]",
+                  argv[0]);
+    }
+    if (n <= 0 || period <= 0) errx (1, "invalid arguments");
+
+    if (dev) {
+        fd = open (dev, O_RDONLY);
+        if (fd < 0) err (1, "open %s", dev);
+    }
+
+    late = malloc (n * sizeof (late[0]));
+    if (!late) errx (1, "malloc %zu failed", n * sizeof (late[0]));
+
+    deadline = now ();
+    for (i = 0; i < n; ++i) {
+        deadline += period * 1000ull;
+        ts.tv_sec = deadline / 1000000000;
+        ts.tv_nsec = deadline % 1000000000;
+        while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+            ;
+        late[i] = now () - deadline;
+        sum += late[i];
+    }
+
+    if (fd >= 0) close (fd);
+
+    qsort (late, n, sizeof (late[0]), cmp);
+    printf ("%s: n=%d min=%.2f avg=%.2f median=%.2f p99=%.2f max=%.2f us\n",
+            dev ? dev : "no module",
+            n,
+            late[0] * 1e-3,
+            (double) sum / n * 1e-3,
+            late[n / 2] * 1e-3,
+            late[n - 1 - n / 100] * 1e-3,
+            late[n - 1] * 1e-3);
+    return 0;
+}